@@ -0,0 +1,70 @@
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "callbacks.h"
+
+/*
+ * Print the statistics exported by a process that called
+ * EnableCallbackStatsExport. The file is only read, so this
+ * never stops nor locks the process being monitored.
+ *
+ * Usage: callback_stats FILE
+ */
+int main(int argc, char const *argv[]) {
+  struct CALLBACK_STATS_HEADER *header;
+  struct CALLBACK_STATS_SLOT snapshot;
+  struct stat st;
+  uint32_t i;
+  int fd;
+
+  if (argc != 2) {
+    fprintf(stderr, "Usage: %s FILE\n", argv[0]);
+    return 2;
+  }
+  fd = open(argv[1], O_RDONLY);
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    perror(argv[1]);
+    return 1;
+  }
+  if ((size_t)st.st_size < sizeof(struct CALLBACK_STATS_HEADER)) {
+    fprintf(stderr, "%s: not a callback statistics file\n", argv[1]);
+    return 1;
+  }
+  header = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (header == MAP_FAILED) {
+    perror(argv[1]);
+    return 1;
+  }
+  if (__atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) !=
+          CALLBACK_STATS_MAGIC ||
+      header->version != CALLBACK_STATS_VERSION ||
+      sizeof(struct CALLBACK_STATS_HEADER) +
+              header->nslots * sizeof(struct CALLBACK_STATS_SLOT) >
+          (size_t)st.st_size) {
+    fprintf(stderr, "%s: not a callback statistics file\n", argv[1]);
+    return 1;
+  }
+
+  printf("%-32s %8s %12s %12s %12s %16s\n", "NAME", "ID", "EXECUTIONS",
+         "FAILURES", "LAST STATUS", "TOTAL TIME (us)");
+  for (i = 0; i < header->nslots; i++) {
+    if (ReadCallbackStatsSlot(&header->slots[i], &snapshot) !=
+        CALLBACK_SUCCESS) {
+      printf("slot %u is busy, skipped\n", i);
+      continue;
+    }
+    if (!snapshot.in_use) continue;
+    printf("%-32s %8d %12llu %12llu %12d %16llu\n", snapshot.name, snapshot.id,
+           (unsigned long long)snapshot.executions,
+           (unsigned long long)snapshot.failures, snapshot.last_status,
+           (unsigned long long)(snapshot.total_ns / 1000));
+  }
+  if (header->dropped) {
+    printf("%u callbacks not exported: no free slot\n", header->dropped);
+  }
+  munmap(header, st.st_size);
+  return 0;
+}
@@ -1,25 +1,160 @@
 #include "callbacks.h"
 
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/eventfd.h>
+#include <malloc.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
 #define TCH_LOG(...)
 
 #define STACK_ARRAY_INITIAL_SIZE 512
+#define NAME_TABLE_INITIAL_SIZE 64
+#define ID_TABLE_INITIAL_SIZE 16
+#define NODE_POOL_MAX_SIZE 512
+#define TRIGGER_SLOTS 64
 struct CALLBACK_NODE {
   int id;                     /* The id for this callback */
   int status;                 /* The status retuned by its execution */
   int executed;               /* Does it need to be executed? */
   int total_executions;       /* Total times it has been executed */
-  char name[MAXSIZENAME];     /* Friendly name for callback */
+  int name_id;                /* Interned friendly name for callback */
+  unsigned long deadline_ms;  /* Watchdog deadline, zero if unbounded */
+  int stats_slot;             /* Exported statistics slot, or -1 */
+  int max_attempts;           /* Attempts under the retry policy, 0: default */
+  unsigned long backoff_ms;   /* First retry delay, 0: default */
+  int attempts;               /* Attempts made by the last execution */
+  int attempt_status[CALLBACK_MAX_ATTEMPTS]; /* Status of each attempt */
+  uint64_t retry_at;          /* When the next attempt is due (ns), or 0 */
+  struct CALLBACK_CLAIM *claim; /* Shared with the snapshot, if id < 0 */
   void *arg;                  /* Custom argument to be sent to the callback */
   CALLBACK_FUNC callback;     /* The callback function pointer */
   struct CALLBACK_NODE *next; /* Next element on the stack */
+  struct CALLBACK_NODE *name_next; /* Next element with the same name */
+};
+
+struct CALLBACK_NAME {
+  char *str;                  /* Interned name, NULL if the slot is free */
+  unsigned int hash;          /* Cached hash of str */
+  int refs;                   /* Number of nodes using this name */
+  int next;                   /* Next slot on the bucket chain or free list */
+  struct CALLBACK_NODE *nodes; /* Nodes registered with this name (LIFO) */
+};
+
+struct CALLBACK_NAME_TABLE {
+  struct CALLBACK_NAME *names; /* Slots indexed by name id */
+  int capacity;               /* Allocated slots */
+  int used;                   /* Slots ever handed out */
+  int live;                   /* Slots currently holding a name */
+  int free_list;              /* First released slot, or -1 */
+  int *buckets;               /* Hash buckets holding the first name id */
+  int nbuckets;               /* Number of buckets (power of two) */
+};
+
+struct CALLBACK_ID_ENTRY {
+  int id;                     /* The id these counters belong to */
+  int pending;                /* Nonexecuted callbacks with this id */
+  int fd;                     /* eventfd readable while pending, or -1 */
+  int nodes;                  /* Callbacks registered with this id */
+  int peak_nodes;             /* Highest value nodes ever had */
+  int next;                   /* Next entry on the bucket chain */
+};
+
+struct CALLBACK_ID_TABLE {
+  struct CALLBACK_ID_ENTRY *entries; /* One entry per nonzero id */
+  int capacity;               /* Allocated entries */
+  int used;                   /* Entries in use */
+  int *buckets;               /* Hash buckets holding the first entry */
+  int nbuckets;               /* Number of buckets (power of two) */
+  int pending;                /* Nonexecuted callbacks with id >= 0 */
+  int fd;                     /* eventfd readable while pending, or -1 */
+  int nodes;                  /* Callbacks registered with id >= 0 */
+  int peak_nodes;             /* Highest value nodes ever had */
+};
+
+struct CALLBACK_MEMORY {
+  int nodes;                  /* Registered callbacks */
+  int peak_nodes;             /* Highest value nodes ever had */
+  int limit;                  /* Maximum registered callbacks, 0: no limit */
+  struct CALLBACK_NODE *pool; /* Released nodes kept for reuse */
+  int pooled;                 /* Nodes in the pool */
+  size_t bytes;               /* Heap memory held by the registry */
+  size_t peak_bytes;          /* Highest value bytes ever had */
+};
+
+struct CALLBACK_EXPORT {
+  struct CALLBACK_STATS_HEADER *header; /* Shared mapping, NULL if disabled */
+  size_t size;                /* Size of the mapping */
+  int fd;                     /* Backing file */
+  int *free_slots;            /* Stack of unused slots */
+  int nfree;                  /* Number of unused slots */
+};
+
+struct CALLBACK_CLAIM {
+  int claimed;                /* Has it run since it was (re)armed? */
+  struct CALLBACK_CLAIM *retired_next; /* Next claim waiting to be freed */
+};
+
+struct CALLBACK_EMERGENCY_ENTRY {
+  CALLBACK_FUNC callback;     /* The callback function pointer */
+  void *arg;                  /* Custom argument to be sent to the callback */
+  int id;                     /* The (negative) id for this callback */
+  struct CALLBACK_CLAIM *claim; /* Same claim as the node */
+};
+
+struct CALLBACK_EMERGENCY {
+  struct CALLBACK_EMERGENCY *retired_next; /* Next snapshot waiting to be freed */
+  int count;                  /* Number of entries */
+  struct CALLBACK_EMERGENCY_ENTRY entries[]; /* Same order as the stack */
+};
+
+struct CALLBACK_SELECTOR {
+  int id;                     /* Id to match (0 selects all positive ids) */
+  int name_id;                /* Name to match, or -1 to select by id */
+  const char *name;           /* Name resolved into name_id under the lock */
+  const int *ids;             /* Ids to match instead of id, if nids > 0 */
+  int nids;
+};
+
+struct CALLBACK_WATCHDOG {
+  pthread_t thread;           /* Thread checking for overruns */
+  pthread_mutex_t mutex;      /* Protects last_overrun */
+  int running;                /* WATCHDOG_STOPPED, _STARTING or _RUNNING */
+  int busy;                   /* Is the watchdog inspecting current_node? */
+  unsigned long period_ms;    /* Sleep between two checks */
+  unsigned long now;          /* Coarse clock in ms, updated every period */
+  unsigned long start;        /* Clock when current_node started, or zero */
+  struct CALLBACK_NODE *reported_node;  /* Last overrun already reported */
+  unsigned long reported_start;
+  unsigned long overruns;     /* Total overruns detected */
+  struct CALLBACK_OVERRUN last_overrun;
+  CALLBACK_OVERRUN_HOOK hook; /* Called from the watchdog thread */
 };
 
 struct CALLBACK_STATE {
   struct CALLBACK_NODE *stack;
   struct CALLBACK_NODE *current_node;
+  struct CALLBACK_NAME_TABLE names;
+  struct CALLBACK_ID_TABLE ids;
+  struct CALLBACK_EXPORT export;
+  struct CALLBACK_MEMORY memory;
+  struct CALLBACK_EMERGENCY *emergency; /* Negative id callbacks, or NULL */
+  struct CALLBACK_EMERGENCY *retired;   /* Replaced snapshots */
+  struct CALLBACK_CLAIM *retired_claims; /* Claims of removed callbacks */
+  int emergency_readers;      /* ExecuteEmergencyCallbacks in progress */
+  struct CALLBACK_WATCHDOG watchdog;
+  int triggers[TRIGGER_SLOTS]; /* Triggered nonzero ids, 0 if free */
+  int trigger_all;            /* Was ExecuteCallbacks triggered? */
+  int trigger_dirty;          /* Triggered since the last drain? */
+  int trigger_fd;             /* eventfd readable while dirty, or -1 */
   int policy;
   int status;
-  int (*execPolicy)(void *, int);
+  unsigned int jitter;        /* State of the backoff jitter generator */
+  int (*execPolicy)(void *, const struct CALLBACK_SELECTOR *);
 };
 
 enum {
@@ -27,14 +162,34 @@ enum {
   STACK_LOCKED,
 };
 
+enum {
+  WATCHDOG_STOPPED,
+  WATCHDOG_RUNNING,
+  WATCHDOG_STARTING,
+};
+
 #define FOREACH_NODE(node, stack) \
   for ((node) = (stack); (node); (node) = (node)->next)
 
-#define SHOULD_EXECUTE(node, _id) \
-  ((node)->executed == 0 &&       \
-   (((_id) == 0 && (node)->id > 0) || (node)->id == (_id)))
+#define FOREACH_SELECTED(node, sel)                  \
+  for ((node) = FirstSelected(sel); (node);          \
+       (node) = (sel)->name_id >= 0 ? (node)->name_next : (node)->next)
+
+#define ID_MATCHES(node_id, _id) \
+  (((_id) == 0 && (node_id) > 0) || (node_id) == (_id))
+
+#define SHOULD_EXECUTE(node, sel) \
+  ((node)->executed == 0 && IsSelected((node), (sel)))
+
+static struct CALLBACK_STATE state = {
+    .names = {.free_list = -1},
+    .ids = {.fd = -1},
+    .trigger_fd = -1,
+    .watchdog = {.mutex = PTHREAD_MUTEX_INITIALIZER},
+};
 
-static struct CALLBACK_STATE state;
+/* Nonzero while this thread runs ExecuteEmergencyCallbacks */
+static __thread volatile sig_atomic_t emergency_depth;
 
 // Locking functions
 static int LockStack();
@@ -47,13 +202,75 @@ static void SetStack(struct CALLBACK_NODE *new_stack);
 static struct CALLBACK_NODE *GetCurrent();
 static void SetCurrent(struct CALLBACK_NODE *new_node);
 
+// Name table
+static int InternName(const char *name);
+static int LookupName(const char *name);
+static const char *GetName(int name_id);
+static void LinkNodeName(struct CALLBACK_NODE *node);
+static void UnlinkNodeName(struct CALLBACK_NODE *node);
+static void ReleaseNames();
+
+// Memory accounting
+static void AccountBytes(long delta);
+static struct CALLBACK_NODE *AllocNode();
+static void FreeNode(struct CALLBACK_NODE *node);
+static void AddNodes(int id, int delta);
+
+// Emergency snapshot
+static int RebuildEmergency();
+static void RetireClaim(struct CALLBACK_NODE *node);
+
+// Pending counters
+static unsigned int HashId(int id);
+static struct CALLBACK_ID_ENTRY *FindIdEntry(int id);
+static struct CALLBACK_ID_ENTRY *GetIdEntry(int id);
+static void AddPending(int id, int delta);
+static void ReleaseIds();
+static void CompactIds();
+
+// Statistics export
+static int AcquireStatsSlot(struct CALLBACK_NODE *node);
+static void ReleaseStatsSlot(struct CALLBACK_NODE *node);
+static void ExportStats(struct CALLBACK_NODE *node, uint64_t elapsed_ns);
+
+// Watchdog
+static uint64_t MonotonicNs();
+static unsigned long MonotonicMs();
+static void *WatchdogMain(void *unused);
+static void WaitForWatchdog();
+
 // Policy Helpers
 static void LoadExecPolicy();
+static int ExecuteSelected(void *arg, const struct CALLBACK_SELECTOR *sel);
+static struct CALLBACK_NODE *FirstSelected(const struct CALLBACK_SELECTOR *sel);
+static int IsSelected(const struct CALLBACK_NODE *node,
+                      const struct CALLBACK_SELECTOR *sel);
+static void InvokeCallback(struct CALLBACK_NODE *node, void *parent_arg);
 static int ExecuteCallback(struct CALLBACK_NODE *node, void *parent_arg);
-static int ExecuteCallbacksExecuteAll(void *arg, int id);
-static int ExecuteCallbacksFailFast(void *arg, int id);
+static int ExecuteScheduledRetry(struct CALLBACK_NODE *node, void *arg);
+static int ExecuteCallbacksExecuteAll(void *arg,
+                                      const struct CALLBACK_SELECTOR *sel);
+static int ExecuteCallbacksFailFast(void *arg,
+                                    const struct CALLBACK_SELECTOR *sel);
+static int ExecuteCallbacksRetry(void *arg,
+                                 const struct CALLBACK_SELECTOR *sel);
 
-int RegisterCallback(CALLBACK_FUNC callback, const char *name, void *arg) {
+static void RemoveNode(struct CALLBACK_NODE *node, struct CALLBACK_NODE *prev) {
+  if (prev != NULL) {
+    prev->next = node->next;
+  } else {
+    SetStack(node->next);
+  }
+  UnlinkNodeName(node);
+  if (node->executed == 0) AddPending(node->id, -1);
+  ReleaseStatsSlot(node);
+  RetireClaim(node);
+  AddNodes(node->id, -1);
+  FreeNode(node);
+}
+
+static int RegisterNode(CALLBACK_FUNC callback, const char *name, void *arg,
+                        int id) {
   struct CALLBACK_NODE *node;
 
   if (!LockStack()) {
@@ -61,7 +278,19 @@ int RegisterCallback(CALLBACK_FUNC callback, const char *name, void *arg) {
     return CALLBACK_LOCKED;
   }
 
-  node = calloc(1, sizeof(struct CALLBACK_NODE));
+  if (state.memory.limit && state.memory.nodes >= state.memory.limit) {
+    /* Too many callbacks registered */
+    UnlockStack();
+    return CALLBACK_LIMIT;
+  }
+
+  if (id != 0 && !GetIdEntry(id)) {
+    /* Could not grow the id table. Return failure */
+    UnlockStack();
+    return CALLBACK_FAILURE;
+  }
+
+  node = AllocNode();
 
   if (!node) {
     /* Calloc failed. Return failure */
@@ -69,32 +298,61 @@ int RegisterCallback(CALLBACK_FUNC callback, const char *name, void *arg) {
     return CALLBACK_FAILURE;
   }
 
+  if (id < 0) {
+    node->claim = calloc(1, sizeof(*node->claim));
+    if (!node->claim) {
+      /* Calloc failed. Return failure */
+      FreeNode(node);
+      UnlockStack();
+      return CALLBACK_FAILURE;
+    }
+    AccountBytes(sizeof(*node->claim));
+  }
+
+  node->name_id = InternName(name);
+  if (node->name_id < 0) {
+    /* Could not grow the name table. Return failure */
+    if (node->claim) {
+      AccountBytes(-(long)sizeof(*node->claim));
+      free(node->claim);
+    }
+    FreeNode(node);
+    UnlockStack();
+    return CALLBACK_FAILURE;
+  }
+
+  node->id = id;
   node->callback = callback;
   node->next = GetStack();
   node->arg = arg;
-  strncpy(node->name, name, MAXSIZENAME);
+  node->stats_slot = AcquireStatsSlot(node);
+  LinkNodeName(node);
   SetStack(node);
+  AddPending(id, 1);
+  AddNodes(id, 1);
+
+  if (id < 0 && !RebuildEmergency()) {
+    /* Could not take the emergency snapshot. Return failure */
+    RemoveNode(node, NULL);
+    UnlockStack();
+    return CALLBACK_FAILURE;
+  }
 
   UnlockStack();
   return CALLBACK_SUCCESS;
 }
 
+int RegisterCallback(CALLBACK_FUNC callback, const char *name, void *arg) {
+  return RegisterNode(callback, name, arg, 0);
+}
+
 int RegisterCallbackWithId(CALLBACK_FUNC callback,
                            const char *name, void *arg, int id) {
   if (id == 0) {
     /* Cannot create callback with explicit id of zero. Return failure */
     return CALLBACK_FAILURE;
   }
-  int status = RegisterCallback(callback, name, arg);
-  if (status != CALLBACK_SUCCESS) {
-    /* Error registring a new callback */
-    return status;
-  }
-
-  /* Callback is on the top of the stack */
-  struct CALLBACK_NODE *stack = GetStack();
-  stack->id = id;
-  return CALLBACK_SUCCESS;
+  return RegisterNode(callback, name, arg, id);
 }
 
 int UnregisterCallback(CALLBACK_FUNC callback) {
@@ -116,13 +374,11 @@ int UnregisterCallback(CALLBACK_FUNC callback) {
 
   FOREACH_NODE(node, stack) {
     if (node->callback == callback) {
-      if (prev != NULL) {
-        prev->next = node->next;
-      } else {
-        SetStack(node->next);
-      }
-      free(node);
+      int id = node->id;
+      RemoveNode(node, prev);
       node = NULL;
+      /* On failure the old snapshot stays, its claim is already taken */
+      if (id < 0) RebuildEmergency();
       status = CALLBACK_SUCCESS;
       break;
     }
@@ -135,6 +391,186 @@ int UnregisterCallback(CALLBACK_FUNC callback) {
 
 
 int ExecuteCallbacksWithId(void *arg, int id) {
+  struct CALLBACK_SELECTOR sel = {.id = id, .name_id = -1};
+  return ExecuteSelected(arg, &sel);
+}
+
+int ExecuteCallbacksByName(void *arg, const char *name) {
+  struct CALLBACK_SELECTOR sel = {.name_id = -1, .name = name ?: ""};
+  return ExecuteSelected(arg, &sel);
+}
+
+int ExecuteCallbacks(void *arg) {
+  /* To execute all callbacks with id >= 0, set the id to 0 */
+  return ExecuteCallbacksWithId(arg, 0);
+}
+
+int ExecuteEmergencyCallbacks(void *arg, int id) {
+  struct CALLBACK_EMERGENCY *snapshot;
+  struct CALLBACK_EMERGENCY_ENTRY *entry;
+  int errors = 0;
+  int i;
+
+  /* No locks and no allocations: this may interrupt any other function of
+   * the registry, including a pass that holds the stack. */
+  __atomic_add_fetch(&state.emergency_readers, 1, __ATOMIC_SEQ_CST);
+  emergency_depth++;
+  snapshot = __atomic_load_n(&state.emergency, __ATOMIC_SEQ_CST);
+  for (i = 0; snapshot && i < snapshot->count; i++) {
+    entry = &snapshot->entries[i];
+    if ((id == 0 || entry->id == id) &&
+        !__atomic_exchange_n(&entry->claim->claimed, 1, __ATOMIC_SEQ_CST)) {
+      errors += (entry->callback(entry->arg ?: arg) < 1);
+    }
+  }
+  emergency_depth--;
+  __atomic_sub_fetch(&state.emergency_readers, 1, __ATOMIC_SEQ_CST);
+  return errors;
+}
+
+int SetCallbackLimit(int max_callbacks, int *old_limit) {
+  if (max_callbacks < 0) {
+    return CALLBACK_FAILURE;
+  }
+  if (!LockStack()) {
+    /* If stack is busy, we can't change it. */
+    return CALLBACK_LOCKED;
+  }
+  if (old_limit) *old_limit = state.memory.limit;
+  state.memory.limit = max_callbacks;
+  UnlockStack();
+  return CALLBACK_SUCCESS;
+}
+
+int GetCallbackMemoryStats(struct CALLBACK_MEMORY_STATS *stats) {
+  if (!stats) {
+    return CALLBACK_FAILURE;
+  }
+  if (!LockStack()) {
+    /* If stack is busy, we can't read it. */
+    return CALLBACK_LOCKED;
+  }
+  stats->nodes = state.memory.nodes;
+  stats->peak_nodes = state.memory.peak_nodes;
+  stats->pooled_nodes = state.memory.pooled;
+  stats->bytes = state.memory.bytes;
+  stats->peak_bytes = state.memory.peak_bytes;
+  UnlockStack();
+  return CALLBACK_SUCCESS;
+}
+
+int GetCallbackMemoryStatsWithId(int id, struct CALLBACK_MEMORY_STATS *stats) {
+  struct CALLBACK_ID_ENTRY *entry;
+
+  if (!stats) {
+    return CALLBACK_FAILURE;
+  }
+  if (!LockStack()) {
+    /* If stack is busy, we can't read it. */
+    return CALLBACK_LOCKED;
+  }
+  memset(stats, 0, sizeof(*stats));
+  if (id == 0) {
+    stats->nodes = state.ids.nodes;
+    stats->peak_nodes = state.ids.peak_nodes;
+  } else if ((entry = FindIdEntry(id))) {
+    stats->nodes = entry->nodes;
+    stats->peak_nodes = entry->peak_nodes;
+  }
+  stats->bytes = stats->nodes * sizeof(struct CALLBACK_NODE);
+  stats->peak_bytes = stats->peak_nodes * sizeof(struct CALLBACK_NODE);
+  UnlockStack();
+  return CALLBACK_SUCCESS;
+}
+
+int ShrinkCallbacks() {
+  struct CALLBACK_NODE *node;
+
+  if (!LockStack()) {
+    /* If stack is busy, we can't change it. */
+    return CALLBACK_LOCKED;
+  }
+  while ((node = state.memory.pool)) {
+    state.memory.pool = node->next;
+    free(node);
+  }
+  AccountBytes(-(long)(state.memory.pooled * sizeof(struct CALLBACK_NODE)));
+  state.memory.pooled = 0;
+  /* Forget ids without callbacks, pending executions nor eventfd */
+  CompactIds();
+  malloc_trim(0);
+  UnlockStack();
+  return CALLBACK_SUCCESS;
+}
+
+static void MarkTriggered() {
+  int fd;
+  if (__atomic_exchange_n(&state.trigger_dirty, 1, __ATOMIC_ACQ_REL)) {
+    /* The executor has already been woken up */
+    return;
+  }
+  fd = __atomic_load_n(&state.trigger_fd, __ATOMIC_ACQUIRE);
+  if (fd >= 0) eventfd_write(fd, 1);
+}
+
+int TriggerCallbacks(int id) {
+  unsigned int slot = HashId(id) % TRIGGER_SLOTS;
+  int probes, current;
+
+  if (id == 0) {
+    __atomic_store_n(&state.trigger_all, 1, __ATOMIC_RELEASE);
+    MarkTriggered();
+    return CALLBACK_SUCCESS;
+  }
+  for (probes = 0; probes < TRIGGER_SLOTS; probes++) {
+    current = __atomic_load_n(&state.triggers[slot], __ATOMIC_ACQUIRE);
+    if (current == id) {
+      /* Already triggered, the same pass will take care of it */
+      return CALLBACK_SUCCESS;
+    }
+    if (current == 0 &&
+        __atomic_compare_exchange_n(&state.triggers[slot], &current, id, 0,
+                                    __ATOMIC_RELEASE, __ATOMIC_ACQUIRE)) {
+      MarkTriggered();
+      return CALLBACK_SUCCESS;
+    }
+    if (current == id) return CALLBACK_SUCCESS;
+    slot = (slot + 1) % TRIGGER_SLOTS;
+  }
+  /* Too many distinct ids waiting for the executor */
+  return CALLBACK_FAILURE;
+}
+
+static void ClearTriggered() {
+  eventfd_t value;
+  int fd = __atomic_load_n(&state.trigger_fd, __ATOMIC_ACQUIRE);
+  /* Drain first: whoever dirties the table after this writes it again */
+  if (fd >= 0) eventfd_read(fd, &value);
+  __atomic_store_n(&state.trigger_dirty, 0, __ATOMIC_SEQ_CST);
+}
+
+static int DrainTriggers(int *ids) {
+  int nids = 0;
+  int i;
+  ClearTriggered();
+  if (__atomic_exchange_n(&state.trigger_all, 0, __ATOMIC_ACQUIRE)) {
+    ids[nids++] = 0;
+  }
+  for (i = 0; i < TRIGGER_SLOTS; i++) {
+    if (__atomic_load_n(&state.triggers[i], __ATOMIC_RELAXED) != 0) {
+      ids[nids] = __atomic_exchange_n(&state.triggers[i], 0, __ATOMIC_ACQUIRE);
+      nids += (ids[nids] != 0);
+    }
+  }
+  return nids;
+}
+
+int RunTriggeredCallbacks(void *arg) {
+  int ids[TRIGGER_SLOTS + 1];
+  struct CALLBACK_SELECTOR sel = {.name_id = -1, .ids = ids};
+  int errors = 0;
+  int pass;
+
   if (!LockStack()) {
     /* If stack is busy, we can't change it. */
     return CALLBACK_LOCKED;
@@ -142,15 +578,38 @@ int ExecuteCallbacksWithId(void *arg, int id) {
   if (state.execPolicy == NULL) {
     LoadExecPolicy();
   }
-  int errors = state.execPolicy(arg, id);
-
+  /* Whatever gets triggered during the first pass is handled by a single
+   * follow-up pass. Later triggers wait for the next call. */
+  for (pass = 0; pass < 2; pass++) {
+    sel.nids = DrainTriggers(ids);
+    if (sel.nids == 0) break;
+    errors += state.execPolicy(arg, &sel);
+  }
   UnlockStack();
   return errors;
 }
 
-int ExecuteCallbacks(void *arg) {
-  /* To execute all callbacks with id >= 0, set the id to 0 */
-  return ExecuteCallbacksWithId(arg, 0);
+int GetTriggerEventFd() {
+  int fd;
+
+  if (!LockStack()) {
+    /* If stack is busy, we can't change it. */
+    return CALLBACK_LOCKED;
+  }
+  if (state.trigger_fd < 0) {
+    fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fd < 0) {
+      UnlockStack();
+      return CALLBACK_FAILURE;
+    }
+    __atomic_store_n(&state.trigger_fd, fd, __ATOMIC_RELEASE);
+    /* Triggered before the eventfd existed */
+    if (__atomic_load_n(&state.trigger_dirty, __ATOMIC_SEQ_CST)) {
+      eventfd_write(fd, 1);
+    }
+  }
+  UnlockStack();
+  return state.trigger_fd;
 }
 
 void ReleaseCallbacks() {
@@ -167,110 +626,1183 @@ void ReleaseCallbacks() {
     stack = stack->next;
     offset =
         sprintf(message, "Releasing Callback[%s] ID[%d] Total Executions[%d]",
-                node->name, node->id, node->total_executions);
+                GetName(node->name_id), node->id, node->total_executions);
     if (node->total_executions > 0)
       sprintf(message + offset, " Last ExitStatus[%d]", node->status);
     TCH_LOG(LOG_ALWAYS, "%s\n", message);
-    free(node);
+    ReleaseStatsSlot(node);
+    RetireClaim(node);
+    FreeNode(node);
   }
+  state.memory.nodes = 0;
   SetStack(NULL);
+  RebuildEmergency();
+  ReleaseNames();
+  ReleaseIds();
+  /* Stale triggers must not run callbacks registered later */
+  memset(state.triggers, 0, sizeof(state.triggers));
+  state.trigger_all = 0;
+  ClearTriggered();
   UnlockStack();
 }
 
-int IsRunningAsCallback() { return IsStackLocked(); }
+int GetCallbackStatsByName(const char *name, struct CALLBACK_STATS *stats) {
+  struct CALLBACK_NODE *node;
+  int name_id;
 
-int ReRegisterItself() {
-  struct CALLBACK_NODE *node = GetCurrent();
-  if (!IsRunningAsCallback() || !node) {
+  if (!stats) {
+    return CALLBACK_FAILURE;
+  }
+  if (!LockStack()) {
+    /* If stack is busy, we can't read it. */
+    return CALLBACK_LOCKED;
+  }
+  memset(stats, 0, sizeof(*stats));
+  name_id = LookupName(name);
+  if (name_id < 0) {
+    UnlockStack();
     return CALLBACK_FAILURE;
   }
-  node->executed = 0;
+  for (node = state.names.names[name_id].nodes; node; node = node->name_next) {
+    stats->registered++;
+    stats->pending += (node->executed == 0);
+    stats->total_executions += node->total_executions;
+    stats->failed += (node->total_executions > 0 && node->status < 1);
+  }
+  UnlockStack();
   return CALLBACK_SUCCESS;
 }
 
-int SetCallbackExecutionPolicy(int policy) {
-  int old_policy = state.policy;
-  state.policy = policy;
-
-  LoadExecPolicy();
+int HasPendingCallbacks(int id) {
+  struct CALLBACK_ID_ENTRY *entry;
+  int pending;
 
-  return old_policy;
+  if (!LockStack()) {
+    /* If stack is busy, we can't read it. */
+    return CALLBACK_LOCKED;
+  }
+  if (id == 0) {
+    pending = state.ids.pending;
+  } else {
+    entry = FindIdEntry(id);
+    pending = entry ? entry->pending : 0;
+  }
+  UnlockStack();
+  return pending > 0;
 }
 
-static int LockStack() {
-  if (state.status != STACK_FREE) return 0;
-  state.status = STACK_LOCKED;
-  return 1;
-}
+int GetCallbackEventFd(int id) {
+  struct CALLBACK_ID_ENTRY *entry = NULL;
+  int *fd = &state.ids.fd;
+  int pending;
 
-static int UnlockStack() {
-  state.status = STACK_FREE;
-  return 1;
+  if (!LockStack()) {
+    /* If stack is busy, we can't change it. */
+    return CALLBACK_LOCKED;
+  }
+  pending = state.ids.pending;
+  if (id != 0) {
+    if (!(entry = GetIdEntry(id))) {
+      UnlockStack();
+      return CALLBACK_FAILURE;
+    }
+    fd = &entry->fd;
+    pending = entry->pending;
+  }
+  if (*fd < 0) {
+    *fd = eventfd(pending > 0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (*fd < 0) {
+      UnlockStack();
+      return CALLBACK_FAILURE;
+    }
+  }
+  UnlockStack();
+  return *fd;
 }
 
-static int IsStackLocked() { return state.status == STACK_LOCKED; }
+int CloseCallbackEventFds() {
+  struct CALLBACK_ID_TABLE *table = &state.ids;
+  int fd;
+  int i;
 
-static struct CALLBACK_NODE *GetStack() { return state.stack; }
-
-static void SetStack(struct CALLBACK_NODE *new_stack) {
-  state.stack = new_stack;
+  if (!LockStack()) {
+    /* If stack is busy, we can't change it. */
+    return CALLBACK_LOCKED;
+  }
+  for (i = 0; i < table->used; i++) {
+    if (table->entries[i].fd >= 0) close(table->entries[i].fd);
+    table->entries[i].fd = -1;
+  }
+  if (table->fd >= 0) close(table->fd);
+  table->fd = -1;
+  CompactIds();
+  fd = __atomic_exchange_n(&state.trigger_fd, -1, __ATOMIC_ACQ_REL);
+  if (fd >= 0) close(fd);
+  UnlockStack();
+  return CALLBACK_SUCCESS;
 }
 
-static struct CALLBACK_NODE *GetCurrent() { return state.current_node; }
+int EnableCallbackStatsExport(const char *path, int max_callbacks) {
+  struct CALLBACK_EXPORT *export = &state.export;
+  struct CALLBACK_NODE *node;
+  int i;
 
-static void SetCurrent(struct CALLBACK_NODE *new_node) {
-  state.current_node = new_node;
-}
+  if (!path || max_callbacks <= 0) {
+    return CALLBACK_FAILURE;
+  }
+  if (!LockStack()) {
+    /* If stack is busy, we can't change it. */
+    return CALLBACK_LOCKED;
+  }
+  if (export->header) {
+    /* Already exporting */
+    UnlockStack();
+    return CALLBACK_FAILURE;
+  }
 
-static void LoadExecPolicy() {
-  switch (state.policy) {
-    case CALLBACK_POLICY_FAIL_FAST:
-      state.execPolicy = ExecuteCallbacksFailFast;
-      break;
-    case CALLBACK_POLICY_EXECUTE_ALL:
-    default:
-      state.execPolicy = ExecuteCallbacksExecuteAll;
-      break;
+  export->size = sizeof(struct CALLBACK_STATS_HEADER) +
+                 max_callbacks * sizeof(struct CALLBACK_STATS_SLOT);
+  export->free_slots = malloc(max_callbacks * sizeof(int));
+  export->fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (!export->free_slots || export->fd < 0 ||
+      ftruncate(export->fd, export->size) != 0 ||
+      (export->header = mmap(NULL, export->size, PROT_READ | PROT_WRITE,
+                             MAP_SHARED, export->fd, 0)) == MAP_FAILED) {
+    if (export->fd >= 0) close(export->fd);
+    free(export->free_slots);
+    memset(export, 0, sizeof(*export));
+    UnlockStack();
+    return CALLBACK_FAILURE;
   }
-}
 
-static int ExecuteCallback(struct CALLBACK_NODE *node, void *parent_arg) {
-  if (node->executed == 0) {
-    node->executed = 1;
-    SetCurrent(node);
-    node->status = node->callback(node->arg ?: parent_arg);
-    node->total_executions++;
-    SetCurrent(NULL);
-    TCH_LOG(LOG_ALWAYS, "Callback[%s] ID[%d] ExitStatus[%d]\n", node->name,
-            node->id, node->status);
+  /* The file was truncated, so all slots start zeroed */
+  export->header->version = CALLBACK_STATS_VERSION;
+  export->header->nslots = max_callbacks;
+  for (i = 0; i < max_callbacks; i++) {
+    export->free_slots[i] = max_callbacks - 1 - i;
   }
-  return (node->status < 1);
+  export->nfree = max_callbacks;
+
+  /* Export the callbacks that are already registered */
+  FOREACH_NODE(node, GetStack()) { node->stats_slot = AcquireStatsSlot(node); }
+
+  /* Publish the magic last so readers only see a complete header */
+  __atomic_store_n(&export->header->magic, CALLBACK_STATS_MAGIC,
+                   __ATOMIC_RELEASE);
+  UnlockStack();
+  return CALLBACK_SUCCESS;
 }
 
-static int ExecuteCallbacksFailFast(void *arg, int id) {
-  TCH_LOG(LOG_ALWAYS, "CallbackExecutionPolicy: ExecuteCallbacksFailFast\n");
+int DisableCallbackStatsExport() {
+  struct CALLBACK_EXPORT *export = &state.export;
   struct CALLBACK_NODE *node;
-  struct CALLBACK_NODE *stack = GetStack();
-  int ret;
-  FOREACH_NODE(node, stack) {
-    if (SHOULD_EXECUTE(node, id)) {
-      if ((ret = ExecuteCallback(node, arg)) < 1) return ret;
-    }
-  }
-  return 1;
-}
 
-static int ExecuteCallbacksExecuteAll(void *arg, int id) {
+  if (!LockStack()) {
+    /* If stack is busy, we can't change it. */
+    return CALLBACK_LOCKED;
+  }
+  if (export->header) {
+    FOREACH_NODE(node, GetStack()) { node->stats_slot = -1; }
+    munmap(export->header, export->size);
+    close(export->fd);
+    free(export->free_slots);
+    memset(export, 0, sizeof(*export));
+  }
+  UnlockStack();
+  return CALLBACK_SUCCESS;
+}
+
+int ReadCallbackStatsSlot(const struct CALLBACK_STATS_SLOT *slot,
+                          struct CALLBACK_STATS_SLOT *snapshot) {
+  uint32_t before, after;
+  int attempts;
+
+  for (attempts = 0; attempts < CALLBACK_STATS_READ_ATTEMPTS; attempts++) {
+    before = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+    if (before & 1) continue; /* Writer in progress */
+    memcpy(snapshot, slot, sizeof(*snapshot));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    after = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+    if (before == after) {
+      snapshot->seq = before;
+      return CALLBACK_SUCCESS;
+    }
+  }
+  return CALLBACK_LOCKED;
+}
+
+int SetCallbackDeadline(CALLBACK_FUNC callback, unsigned long deadline_ms) {
+  struct CALLBACK_NODE *node;
+  int status = CALLBACK_FAILURE;
+
+  if (!LockStack()) {
+    /* If stack is busy, we can't change it. */
+    return CALLBACK_LOCKED;
+  }
+  FOREACH_NODE(node, GetStack()) {
+    if (node->callback == callback) {
+      node->deadline_ms = deadline_ms;
+      status = CALLBACK_SUCCESS;
+      break;
+    }
+  }
+  UnlockStack();
+  return status;
+}
+
+int SetCallbackRetry(CALLBACK_FUNC callback, int max_attempts,
+                     unsigned long backoff_ms) {
+  struct CALLBACK_NODE *node;
+  int status = CALLBACK_FAILURE;
+
+  if (max_attempts < 0 || max_attempts > CALLBACK_MAX_ATTEMPTS) {
+    return CALLBACK_FAILURE;
+  }
+  if (!LockStack()) {
+    /* If stack is busy, we can't change it. */
+    return CALLBACK_LOCKED;
+  }
+  FOREACH_NODE(node, GetStack()) {
+    if (node->callback == callback) {
+      node->max_attempts = max_attempts;
+      node->backoff_ms = backoff_ms;
+      status = CALLBACK_SUCCESS;
+      break;
+    }
+  }
+  UnlockStack();
+  return status;
+}
+
+int GetCallbackAttempts(CALLBACK_FUNC callback, int *statuses, int size) {
+  struct CALLBACK_NODE *node;
+  int attempts = CALLBACK_FAILURE;
+
+  if (size < 0) {
+    return CALLBACK_FAILURE;
+  }
+  if (!LockStack()) {
+    /* If stack is busy, we can't read it. */
+    return CALLBACK_LOCKED;
+  }
+  FOREACH_NODE(node, GetStack()) {
+    if (node->callback == callback) {
+      attempts = node->attempts;
+      if (statuses) {
+        memcpy(statuses, node->attempt_status,
+               (size < attempts ? size : attempts) * sizeof(int));
+      }
+      break;
+    }
+  }
+  UnlockStack();
+  return attempts;
+}
+
+int GetCallbackRetryDelay(unsigned long *delay_ms) {
+  struct CALLBACK_NODE *node;
+  uint64_t next = 0;
+  uint64_t now;
+
+  if (!delay_ms) {
+    return CALLBACK_FAILURE;
+  }
+  if (!LockStack()) {
+    /* If stack is busy, we can't read it. */
+    return CALLBACK_LOCKED;
+  }
+  FOREACH_NODE(node, GetStack()) {
+    if (node->retry_at && (next == 0 || node->retry_at < next)) {
+      next = node->retry_at;
+    }
+  }
+  UnlockStack();
+  if (next == 0) {
+    return CALLBACK_FAILURE;
+  }
+  now = MonotonicNs();
+  /* Round up, so that waiting that long makes the retry due */
+  *delay_ms = next > now ? (next - now + 999999) / 1000000 : 0;
+  return CALLBACK_SUCCESS;
+}
+
+int StartCallbackWatchdog(unsigned long period_ms, CALLBACK_OVERRUN_HOOK hook) {
+  struct CALLBACK_WATCHDOG *watchdog = &state.watchdog;
+  int expected = WATCHDOG_STOPPED;
+
+  /* Only one caller may go on to create the thread */
+  if (period_ms == 0 ||
+      !__atomic_compare_exchange_n(&watchdog->running, &expected,
+                                   WATCHDOG_STARTING, 0, __ATOMIC_SEQ_CST,
+                                   __ATOMIC_RELAXED)) {
+    return CALLBACK_FAILURE;
+  }
+  watchdog->period_ms = period_ms;
+  watchdog->hook = hook;
+  watchdog->reported_node = NULL;
+  watchdog->reported_start = 0;
+  __atomic_store_n(&watchdog->now, MonotonicMs(), __ATOMIC_RELAXED);
+  if (pthread_create(&watchdog->thread, NULL, WatchdogMain, NULL) != 0) {
+    __atomic_store_n(&watchdog->running, WATCHDOG_STOPPED, __ATOMIC_SEQ_CST);
+    return CALLBACK_FAILURE;
+  }
+  __atomic_store_n(&watchdog->running, WATCHDOG_RUNNING, __ATOMIC_SEQ_CST);
+  return CALLBACK_SUCCESS;
+}
+
+void StopCallbackWatchdog() {
+  struct CALLBACK_WATCHDOG *watchdog = &state.watchdog;
+  int expected = WATCHDOG_RUNNING;
+
+  /* The thread handle is only valid once the watchdog is running */
+  while (!__atomic_compare_exchange_n(&watchdog->running, &expected,
+                                      WATCHDOG_STOPPED, 0, __ATOMIC_SEQ_CST,
+                                      __ATOMIC_RELAXED)) {
+    if (expected == WATCHDOG_STOPPED) return;
+    expected = WATCHDOG_RUNNING;
+    sched_yield();
+  }
+  pthread_join(watchdog->thread, NULL);
+  __atomic_store_n(&watchdog->now, 0, __ATOMIC_RELAXED);
+}
+
+unsigned long GetCallbackOverrunCount() {
+  return __atomic_load_n(&state.watchdog.overruns, __ATOMIC_RELAXED);
+}
+
+int GetLastCallbackOverrun(struct CALLBACK_OVERRUN *overrun) {
+  struct CALLBACK_WATCHDOG *watchdog = &state.watchdog;
+
+  if (!overrun || GetCallbackOverrunCount() == 0) {
+    return CALLBACK_FAILURE;
+  }
+  pthread_mutex_lock(&watchdog->mutex);
+  *overrun = watchdog->last_overrun;
+  pthread_mutex_unlock(&watchdog->mutex);
+  return CALLBACK_SUCCESS;
+}
+
+int IsRunningAsCallback() { return IsStackLocked(); }
+
+int ReRegisterItself() {
+  struct CALLBACK_NODE *node = GetCurrent();
+  if (emergency_depth) {
+    /* The current node belongs to the pass a signal interrupted */
+    return CALLBACK_FAILURE;
+  }
+  if (!IsRunningAsCallback() || !node) {
+    return CALLBACK_FAILURE;
+  }
+  if (node->executed) {
+    node->executed = 0;
+    AddPending(node->id, 1);
+    if (node->claim) {
+      __atomic_store_n(&node->claim->claimed, 0, __ATOMIC_SEQ_CST);
+    }
+  }
+  return CALLBACK_SUCCESS;
+}
+
+int SetCallbackExecutionPolicy(int policy) {
+  int old_policy = state.policy;
+  state.policy = policy;
+
+  LoadExecPolicy();
+
+  return old_policy;
+}
+
+static int LockStack() {
+  int expected = STACK_FREE;
+  if (!__atomic_compare_exchange_n(&state.status, &expected, STACK_LOCKED, 0,
+                                   __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+    return 0;
+  }
+  WaitForWatchdog();
+  return 1;
+}
+
+static int UnlockStack() {
+  __atomic_store_n(&state.status, STACK_FREE, __ATOMIC_SEQ_CST);
+  return 1;
+}
+
+static int IsStackLocked() {
+  return __atomic_load_n(&state.status, __ATOMIC_SEQ_CST) == STACK_LOCKED;
+}
+
+static struct CALLBACK_NODE *GetStack() { return state.stack; }
+
+static void SetStack(struct CALLBACK_NODE *new_stack) {
+  state.stack = new_stack;
+}
+
+static struct CALLBACK_NODE *GetCurrent() {
+  return __atomic_load_n(&state.current_node, __ATOMIC_SEQ_CST);
+}
+
+static void SetCurrent(struct CALLBACK_NODE *new_node) {
+  __atomic_store_n(&state.current_node, new_node, __ATOMIC_SEQ_CST);
+}
+
+static unsigned int HashName(const char *name, size_t len) {
+  /* FNV-1a */
+  unsigned int hash = 2166136261u;
+  size_t i;
+  for (i = 0; i < len; i++) {
+    hash ^= (unsigned char)name[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static size_t NameLength(const char *name) {
+  /* Names keep the historical MAXSIZENAME limit */
+  size_t len = 0;
+  while (len < MAXSIZENAME - 1 && name[len]) len++;
+  return len;
+}
+
+static int FindName(const char *name, size_t len, unsigned int hash) {
+  struct CALLBACK_NAME_TABLE *table = &state.names;
+  int name_id;
+  if (table->nbuckets == 0) return -1;
+  name_id = table->buckets[hash & (table->nbuckets - 1)];
+  while (name_id >= 0) {
+    struct CALLBACK_NAME *entry = &table->names[name_id];
+    if (entry->hash == hash && strncmp(entry->str, name, len) == 0 &&
+        entry->str[len] == '\0') {
+      return name_id;
+    }
+    name_id = entry->next;
+  }
+  return -1;
+}
+
+static int GrowBuckets() {
+  struct CALLBACK_NAME_TABLE *table = &state.names;
+  int nbuckets = table->nbuckets ? table->nbuckets * 2 : NAME_TABLE_INITIAL_SIZE;
+  int *buckets = malloc(nbuckets * sizeof(int));
+  int i;
+  if (!buckets) return 0;
+  AccountBytes((long)(nbuckets - table->nbuckets) * sizeof(int));
+  for (i = 0; i < nbuckets; i++) buckets[i] = -1;
+  for (i = 0; i < table->used; i++) {
+    struct CALLBACK_NAME *entry = &table->names[i];
+    if (!entry->str) continue;
+    entry->next = buckets[entry->hash & (nbuckets - 1)];
+    buckets[entry->hash & (nbuckets - 1)] = i;
+  }
+  free(table->buckets);
+  table->buckets = buckets;
+  table->nbuckets = nbuckets;
+  return 1;
+}
+
+static int InternName(const char *name) {
+  struct CALLBACK_NAME_TABLE *table = &state.names;
+  struct CALLBACK_NAME *entry;
+  char *str;
+  size_t len;
+  unsigned int hash;
+  int name_id;
+
+  if (!name) name = "";
+  len = NameLength(name);
+  hash = HashName(name, len);
+
+  name_id = FindName(name, len, hash);
+  if (name_id >= 0) {
+    table->names[name_id].refs++;
+    return name_id;
+  }
+
+  if (table->live >= table->nbuckets && !GrowBuckets()) {
+    return -1;
+  }
+  if (table->free_list < 0 && table->used == table->capacity) {
+    int capacity =
+        table->capacity ? table->capacity * 2 : NAME_TABLE_INITIAL_SIZE;
+    struct CALLBACK_NAME *names =
+        realloc(table->names, capacity * sizeof(struct CALLBACK_NAME));
+    if (!names) return -1;
+    AccountBytes((long)(capacity - table->capacity) *
+                 sizeof(struct CALLBACK_NAME));
+    table->names = names;
+    table->capacity = capacity;
+  }
+
+  str = malloc(len + 1);
+  if (!str) return -1;
+  AccountBytes(len + 1);
+  memcpy(str, name, len);
+  str[len] = '\0';
+
+  if (table->free_list >= 0) {
+    name_id = table->free_list;
+    table->free_list = table->names[name_id].next;
+  } else {
+    name_id = table->used++;
+  }
+  entry = &table->names[name_id];
+  entry->str = str;
+  entry->hash = hash;
+  entry->refs = 1;
+  entry->nodes = NULL;
+  entry->next = table->buckets[hash & (table->nbuckets - 1)];
+  table->buckets[hash & (table->nbuckets - 1)] = name_id;
+  table->live++;
+  return name_id;
+}
+
+static int LookupName(const char *name) {
+  size_t len;
+  if (!name) name = "";
+  len = NameLength(name);
+  return FindName(name, len, HashName(name, len));
+}
+
+static const char *GetName(int name_id) {
+  return state.names.names[name_id].str;
+}
+
+static void LinkNodeName(struct CALLBACK_NODE *node) {
+  struct CALLBACK_NAME *entry = &state.names.names[node->name_id];
+  node->name_next = entry->nodes;
+  entry->nodes = node;
+}
+
+static void UnlinkNodeName(struct CALLBACK_NODE *node) {
+  struct CALLBACK_NAME_TABLE *table = &state.names;
+  struct CALLBACK_NAME *entry = &table->names[node->name_id];
+  struct CALLBACK_NODE **link;
+  int *slot;
+
+  for (link = &entry->nodes; *link; link = &(*link)->name_next) {
+    if (*link == node) {
+      *link = node->name_next;
+      break;
+    }
+  }
+  if (--entry->refs > 0) return;
+
+  /* Last user of this name: unhook it from its bucket and recycle the slot */
+  for (slot = &table->buckets[entry->hash & (table->nbuckets - 1)];
+       *slot != node->name_id; slot = &table->names[*slot].next) {
+  }
+  *slot = entry->next;
+  AccountBytes(-(long)(strlen(entry->str) + 1));
+  free(entry->str);
+  entry->str = NULL;
+  entry->nodes = NULL;
+  entry->next = table->free_list;
+  table->free_list = node->name_id;
+  table->live--;
+}
+
+static void ReleaseNames() {
+  struct CALLBACK_NAME_TABLE *table = &state.names;
+  int i;
+  for (i = 0; i < table->used; i++) {
+    if (table->names[i].str) {
+      AccountBytes(-(long)(strlen(table->names[i].str) + 1));
+    }
+    free(table->names[i].str);
+  }
+  AccountBytes(-(long)(table->capacity * sizeof(struct CALLBACK_NAME) +
+                       table->nbuckets * sizeof(int)));
+  free(table->names);
+  free(table->buckets);
+  memset(table, 0, sizeof(*table));
+  table->free_list = -1;
+}
+
+static unsigned int HashId(int id) {
+  return (unsigned int)id * 2654435761u;
+}
+
+static struct CALLBACK_ID_ENTRY *FindIdEntry(int id) {
+  struct CALLBACK_ID_TABLE *table = &state.ids;
+  int i;
+  if (table->nbuckets == 0) return NULL;
+  for (i = table->buckets[HashId(id) & (table->nbuckets - 1)]; i >= 0;
+       i = table->entries[i].next) {
+    if (table->entries[i].id == id) return &table->entries[i];
+  }
+  return NULL;
+}
+
+static struct CALLBACK_ID_ENTRY *GetIdEntry(int id) {
+  struct CALLBACK_ID_TABLE *table = &state.ids;
+  struct CALLBACK_ID_ENTRY *entry = FindIdEntry(id);
+  int i;
+
+  if (entry) return entry;
+
+  if (table->used == table->capacity) {
+    int capacity = table->capacity ? table->capacity * 2 : ID_TABLE_INITIAL_SIZE;
+    struct CALLBACK_ID_ENTRY *entries =
+        realloc(table->entries, capacity * sizeof(struct CALLBACK_ID_ENTRY));
+    int *buckets = malloc(capacity * sizeof(int));
+    if (!entries || !buckets) {
+      if (entries) table->entries = entries;
+      free(buckets);
+      return NULL;
+    }
+    AccountBytes((long)(capacity - table->capacity) *
+                 (sizeof(struct CALLBACK_ID_ENTRY) + sizeof(int)));
+    /* Keep as many buckets as entries and rehash everything */
+    for (i = 0; i < capacity; i++) buckets[i] = -1;
+    for (i = 0; i < table->used; i++) {
+      int bucket = HashId(entries[i].id) & (capacity - 1);
+      entries[i].next = buckets[bucket];
+      buckets[bucket] = i;
+    }
+    free(table->buckets);
+    table->entries = entries;
+    table->buckets = buckets;
+    table->capacity = capacity;
+    table->nbuckets = capacity;
+  }
+
+  entry = &table->entries[table->used];
+  entry->id = id;
+  entry->pending = 0;
+  entry->fd = -1;
+  entry->nodes = 0;
+  entry->peak_nodes = 0;
+  entry->next = table->buckets[HashId(id) & (table->nbuckets - 1)];
+  table->buckets[HashId(id) & (table->nbuckets - 1)] = table->used++;
+  return entry;
+}
+
+static void SignalPending(int fd, int pending, int delta) {
+  eventfd_t value;
+  if (fd < 0) return;
+  if (delta > 0 && pending == delta) {
+    /* Nothing was pending before: make the eventfd readable */
+    eventfd_write(fd, 1);
+  } else if (delta < 0 && pending == 0) {
+    /* Nothing is pending anymore: drain the eventfd */
+    eventfd_read(fd, &value);
+  }
+}
+
+static void AddPending(int id, int delta) {
+  struct CALLBACK_ID_ENTRY *entry;
+  if (id >= 0) {
+    state.ids.pending += delta;
+    SignalPending(state.ids.fd, state.ids.pending, delta);
+  }
+  if (id != 0 && (entry = FindIdEntry(id))) {
+    entry->pending += delta;
+    SignalPending(entry->fd, entry->pending, delta);
+  }
+}
+
+static void ReleaseIds() {
+  struct CALLBACK_ID_TABLE *table = &state.ids;
+  struct CALLBACK_ID_ENTRY *entry;
+  eventfd_t value;
+  int i;
+  /* Callers may still watch the eventfds: drain them, but keep them open
+   * along with the entries holding them */
+  for (i = 0; i < table->used; i++) {
+    entry = &table->entries[i];
+    if (entry->fd >= 0) eventfd_read(entry->fd, &value);
+    entry->pending = entry->nodes = entry->peak_nodes = 0;
+  }
+  if (table->fd >= 0) eventfd_read(table->fd, &value);
+  table->pending = table->nodes = table->peak_nodes = 0;
+  CompactIds();
+}
+
+static void CompactIds() {
+  struct CALLBACK_ID_TABLE *table = &state.ids;
+  struct CALLBACK_ID_ENTRY *entry;
+  struct CALLBACK_ID_ENTRY *entries;
+  int *buckets;
+  int capacity;
+  int used = 0;
+  int i;
+
+  for (i = 0; i < table->used; i++) {
+    entry = &table->entries[i];
+    if (entry->nodes > 0 || entry->pending > 0 || entry->fd >= 0) {
+      table->entries[used++] = *entry;
+    }
+  }
+  table->used = used;
+  capacity = table->capacity;
+  while (capacity > ID_TABLE_INITIAL_SIZE && used <= capacity / 4) {
+    capacity /= 2;
+  }
+  if (used > 0 && capacity < table->capacity) {
+    entries = malloc(capacity * sizeof(struct CALLBACK_ID_ENTRY));
+    buckets = malloc(capacity * sizeof(int));
+    if (entries && buckets) {
+      memcpy(entries, table->entries, used * sizeof(struct CALLBACK_ID_ENTRY));
+      AccountBytes(-(long)(table->capacity - capacity) *
+                   (sizeof(struct CALLBACK_ID_ENTRY) + sizeof(int)));
+      free(table->entries);
+      free(table->buckets);
+      table->entries = entries;
+      table->buckets = buckets;
+      table->capacity = table->nbuckets = capacity;
+    } else {
+      /* Keep the larger table */
+      free(entries);
+      free(buckets);
+    }
+  }
+  if (used == 0 && table->capacity > 0) {
+    AccountBytes(-(long)(table->capacity * (sizeof(struct CALLBACK_ID_ENTRY) +
+                                            sizeof(int))));
+    free(table->entries);
+    free(table->buckets);
+    table->entries = NULL;
+    table->buckets = NULL;
+    table->capacity = table->nbuckets = 0;
+    return;
+  }
+  /* Entries moved: rehash them */
+  for (i = 0; i < table->nbuckets; i++) table->buckets[i] = -1;
+  for (i = 0; i < used; i++) {
+    int bucket = HashId(table->entries[i].id) & (table->nbuckets - 1);
+    table->entries[i].next = table->buckets[bucket];
+    table->buckets[bucket] = i;
+  }
+}
+
+static void FreeRetiredEmergency() {
+  struct CALLBACK_EMERGENCY *snapshot;
+  struct CALLBACK_CLAIM *claim;
+  if (__atomic_load_n(&state.emergency_readers, __ATOMIC_SEQ_CST) != 0) {
+    /* Someone may still be walking them, try again on the next rebuild */
+    return;
+  }
+  while ((snapshot = state.retired)) {
+    state.retired = snapshot->retired_next;
+    AccountBytes(-(long)(sizeof(*snapshot) + snapshot->count *
+                                                 sizeof(snapshot->entries[0])));
+    free(snapshot);
+  }
+  while ((claim = state.retired_claims)) {
+    state.retired_claims = claim->retired_next;
+    AccountBytes(-(long)sizeof(*claim));
+    free(claim);
+  }
+}
+
+static int RebuildEmergency() {
+  struct CALLBACK_EMERGENCY *snapshot = NULL;
+  struct CALLBACK_NODE *node;
+  size_t size;
+  int count = 0;
+
+  FOREACH_NODE(node, GetStack()) { count += (node->id < 0); }
+  if (count > 0) {
+    size = sizeof(*snapshot) + count * sizeof(snapshot->entries[0]);
+    snapshot = calloc(1, size);
+    if (!snapshot) return 0;
+    AccountBytes(size);
+    FOREACH_NODE(node, GetStack()) {
+      if (node->id < 0) {
+        snapshot->entries[snapshot->count].callback = node->callback;
+        snapshot->entries[snapshot->count].arg = node->arg;
+        snapshot->entries[snapshot->count].id = node->id;
+        snapshot->entries[snapshot->count].claim = node->claim;
+        snapshot->count++;
+      }
+    }
+  }
+
+  snapshot = __atomic_exchange_n(&state.emergency, snapshot, __ATOMIC_SEQ_CST);
+  if (snapshot) {
+    snapshot->retired_next = state.retired;
+    state.retired = snapshot;
+  }
+  FreeRetiredEmergency();
+  return 1;
+}
+
+static void RetireClaim(struct CALLBACK_NODE *node) {
+  if (!node->claim) return;
+  /* A snapshot still holding it must never run the removed callback. It
+   * is freed along with the snapshots replaced before it was retired. */
+  __atomic_store_n(&node->claim->claimed, 1, __ATOMIC_SEQ_CST);
+  node->claim->retired_next = state.retired_claims;
+  state.retired_claims = node->claim;
+  node->claim = NULL;
+}
+
+static void AccountBytes(long delta) {
+  state.memory.bytes += delta;
+  if (state.memory.bytes > state.memory.peak_bytes) {
+    state.memory.peak_bytes = state.memory.bytes;
+  }
+}
+
+static struct CALLBACK_NODE *AllocNode() {
+  struct CALLBACK_NODE *node = state.memory.pool;
+  if (node) {
+    state.memory.pool = node->next;
+    state.memory.pooled--;
+    memset(node, 0, sizeof(*node));
+    return node;
+  }
+  node = calloc(1, sizeof(struct CALLBACK_NODE));
+  if (node) AccountBytes(sizeof(struct CALLBACK_NODE));
+  return node;
+}
+
+static void FreeNode(struct CALLBACK_NODE *node) {
+  if (state.memory.pooled >= NODE_POOL_MAX_SIZE) {
+    /* Pool is full, give it back right away */
+    AccountBytes(-(long)sizeof(struct CALLBACK_NODE));
+    free(node);
+    return;
+  }
+  /* Keep it for the next registration, ShrinkCallbacks gives it back */
+  node->next = state.memory.pool;
+  state.memory.pool = node;
+  state.memory.pooled++;
+}
+
+static void AddNodes(int id, int delta) {
+  struct CALLBACK_ID_ENTRY *entry;
+  state.memory.nodes += delta;
+  if (state.memory.nodes > state.memory.peak_nodes) {
+    state.memory.peak_nodes = state.memory.nodes;
+  }
+  if (id >= 0) {
+    state.ids.nodes += delta;
+    if (state.ids.nodes > state.ids.peak_nodes) {
+      state.ids.peak_nodes = state.ids.nodes;
+    }
+  }
+  if (id != 0 && (entry = FindIdEntry(id))) {
+    entry->nodes += delta;
+    if (entry->nodes > entry->peak_nodes) entry->peak_nodes = entry->nodes;
+  }
+}
+
+static void BeginSlotWrite(struct CALLBACK_STATS_SLOT *slot) {
+  /* Only one writer at a time: the stack is locked */
+  __atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void EndSlotWrite(struct CALLBACK_STATS_SLOT *slot) {
+  __atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELEASE);
+}
+
+static int AcquireStatsSlot(struct CALLBACK_NODE *node) {
+  struct CALLBACK_EXPORT *export = &state.export;
+  struct CALLBACK_STATS_SLOT *slot;
+  int index;
+
+  if (!export->header) return -1;
+  if (export->nfree == 0) {
+    /* Out of slots, this callback won't be visible */
+    __atomic_add_fetch(&export->header->dropped, 1, __ATOMIC_RELAXED);
+    return -1;
+  }
+  index = export->free_slots[--export->nfree];
+  slot = &export->header->slots[index];
+  BeginSlotWrite(slot);
+  slot->in_use = 1;
+  slot->id = node->id;
+  /* Counters cover executions since the callback got its slot */
+  slot->last_status = 0;
+  slot->executions = 0;
+  slot->failures = 0;
+  slot->total_ns = 0;
+  strncpy(slot->name, GetName(node->name_id), MAXSIZENAME - 1);
+  slot->name[MAXSIZENAME - 1] = '\0';
+  EndSlotWrite(slot);
+  return index;
+}
+
+static void ReleaseStatsSlot(struct CALLBACK_NODE *node) {
+  struct CALLBACK_EXPORT *export = &state.export;
+  struct CALLBACK_STATS_SLOT *slot;
+
+  if (!export->header || node->stats_slot < 0) return;
+  slot = &export->header->slots[node->stats_slot];
+  BeginSlotWrite(slot);
+  slot->in_use = 0;
+  EndSlotWrite(slot);
+  export->free_slots[export->nfree++] = node->stats_slot;
+  node->stats_slot = -1;
+}
+
+static void ExportStats(struct CALLBACK_NODE *node, uint64_t elapsed_ns) {
+  struct CALLBACK_STATS_SLOT *slot;
+
+  if (node->stats_slot < 0) return;
+  slot = &state.export.header->slots[node->stats_slot];
+  BeginSlotWrite(slot);
+  slot->executions++;
+  slot->failures += (node->status < 1);
+  slot->last_status = node->status;
+  slot->total_ns += elapsed_ns;
+  EndSlotWrite(slot);
+}
+
+static uint64_t MonotonicNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static unsigned long MonotonicMs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  /* Never return zero, it means "not running" for watchdog->start */
+  return (unsigned long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000 + 1;
+}
+
+static int CheckOverrun(struct CALLBACK_OVERRUN *overrun) {
+  struct CALLBACK_WATCHDOG *watchdog = &state.watchdog;
+  struct CALLBACK_NODE *node;
+  unsigned long start;
+  unsigned long now = watchdog->now;
+  int found = 0;
+
+  /* While busy is set, nobody can take the stack (see WaitForWatchdog) */
+  __atomic_store_n(&watchdog->busy, 1, __ATOMIC_SEQ_CST);
+  node = GetCurrent();
+  start = __atomic_load_n(&watchdog->start, __ATOMIC_SEQ_CST);
+  /* Make sure start belongs to node and not to the one that follows it */
+  if (node && start && node == GetCurrent() && node->deadline_ms &&
+      now - start > node->deadline_ms &&
+      (node != watchdog->reported_node || start != watchdog->reported_start)) {
+    watchdog->reported_node = node;
+    watchdog->reported_start = start;
+    overrun->id = node->id;
+    overrun->deadline_ms = node->deadline_ms;
+    overrun->elapsed_ms = now - start;
+    strncpy(overrun->name, GetName(node->name_id), MAXSIZENAME - 1);
+    overrun->name[MAXSIZENAME - 1] = '\0';
+    found = 1;
+  }
+  __atomic_store_n(&watchdog->busy, 0, __ATOMIC_SEQ_CST);
+  return found;
+}
+
+static void *WatchdogMain(void *unused) {
+  struct CALLBACK_WATCHDOG *watchdog = &state.watchdog;
+  struct CALLBACK_OVERRUN overrun;
+  struct timespec period;
+
+  period.tv_sec = watchdog->period_ms / 1000;
+  period.tv_nsec = (watchdog->period_ms % 1000) * 1000000;
+  while (__atomic_load_n(&watchdog->running, __ATOMIC_SEQ_CST)) {
+    __atomic_store_n(&watchdog->now, MonotonicMs(), __ATOMIC_RELAXED);
+    if (CheckOverrun(&overrun)) {
+      pthread_mutex_lock(&watchdog->mutex);
+      watchdog->last_overrun = overrun;
+      pthread_mutex_unlock(&watchdog->mutex);
+      __atomic_add_fetch(&watchdog->overruns, 1, __ATOMIC_RELAXED);
+      TCH_LOG(LOG_ALWAYS, "Callback[%s] ID[%d] Overrun[%lu ms]\n",
+              overrun.name, overrun.id, overrun.elapsed_ms);
+      if (watchdog->hook) watchdog->hook(&overrun);
+    }
+    nanosleep(&period, NULL);
+  }
+  return NULL;
+}
+
+static void WaitForWatchdog() {
+  /* Called right after locking the stack. The watchdog may have read
+   * current_node before the previous owner released the stack and still be
+   * reading that node or its name. Let it finish before the new owner
+   * frees, reuses or reallocates any of that memory. Any inspection that
+   * starts later sees current_node as NULL. */
+  while (__atomic_load_n(&state.watchdog.busy, __ATOMIC_SEQ_CST)) {
+    /* It may have been preempted in the middle of CheckOverrun */
+    sched_yield();
+  }
+}
+
+static void LoadExecPolicy() {
+  switch (state.policy) {
+    case CALLBACK_POLICY_FAIL_FAST:
+      state.execPolicy = ExecuteCallbacksFailFast;
+      break;
+    case CALLBACK_POLICY_RETRY:
+      state.execPolicy = ExecuteCallbacksRetry;
+      break;
+    case CALLBACK_POLICY_EXECUTE_ALL:
+    default:
+      state.execPolicy = ExecuteCallbacksExecuteAll;
+      break;
+  }
+}
+
+static int ExecuteSelected(void *arg, const struct CALLBACK_SELECTOR *sel) {
+  struct CALLBACK_SELECTOR resolved = *sel;
+  if (!LockStack()) {
+    /* If stack is busy, we can't change it. */
+    return CALLBACK_LOCKED;
+  }
+  if (resolved.name) {
+    /* Resolve the name while nobody can recycle its slot */
+    resolved.name_id = LookupName(resolved.name);
+    if (resolved.name_id < 0) {
+      /* No callback is registered with this name */
+      UnlockStack();
+      return 0;
+    }
+  }
+  if (state.execPolicy == NULL) {
+    LoadExecPolicy();
+  }
+  int errors = state.execPolicy(arg, &resolved);
+
+  UnlockStack();
+  return errors;
+}
+
+static struct CALLBACK_NODE *FirstSelected(
+    const struct CALLBACK_SELECTOR *sel) {
+  if (sel->name_id >= 0) {
+    return state.names.names[sel->name_id].nodes;
+  }
+  return GetStack();
+}
+
+static void InvokeCallback(struct CALLBACK_NODE *node, void *parent_arg) {
+  uint64_t started = 0;
+  SetCurrent(node);
+  if (node->deadline_ms) {
+    /* Coarse clock maintained by the watchdog, zero if it isn't running */
+    __atomic_store_n(&state.watchdog.start,
+                     __atomic_load_n(&state.watchdog.now, __ATOMIC_RELAXED),
+                     __ATOMIC_SEQ_CST);
+  }
+  if (node->stats_slot >= 0) started = MonotonicNs();
+  node->status = node->callback(node->arg ?: parent_arg);
+  node->total_executions++;
+  if (node->attempts < CALLBACK_MAX_ATTEMPTS) {
+    node->attempt_status[node->attempts++] = node->status;
+  }
+  if (node->stats_slot >= 0) ExportStats(node, MonotonicNs() - started);
+  if (node->deadline_ms) {
+    __atomic_store_n(&state.watchdog.start, 0, __ATOMIC_SEQ_CST);
+  }
+  SetCurrent(NULL);
+  TCH_LOG(LOG_ALWAYS, "Callback[%s] ID[%d] ExitStatus[%d]\n",
+          GetName(node->name_id), node->id, node->status);
+}
+
+static int IsSelected(const struct CALLBACK_NODE *node,
+                      const struct CALLBACK_SELECTOR *sel) {
+  int i;
+  /* Like ExecuteCallbacks, names never select negative ids */
+  if (sel->name_id >= 0) return node->id >= 0;
+  if (sel->nids == 0) return ID_MATCHES(node->id, sel->id);
+  for (i = 0; i < sel->nids; i++) {
+    if (ID_MATCHES(node->id, sel->ids[i])) return 1;
+  }
+  return 0;
+}
+
+static int ExecuteCallback(struct CALLBACK_NODE *node, void *parent_arg) {
+  if (node->executed == 0) {
+    node->executed = 1;
+    node->attempts = 0;
+    node->retry_at = 0;
+    AddPending(node->id, -1);
+    if (node->claim &&
+        __atomic_exchange_n(&node->claim->claimed, 1, __ATOMIC_SEQ_CST)) {
+      /* Already run by ExecuteEmergencyCallbacks */
+      return 0;
+    }
+    InvokeCallback(node, parent_arg);
+  }
+  return (node->status < 1);
+}
+
+static int ExecuteScheduledRetry(struct CALLBACK_NODE *node, void *arg) {
+  /* Left behind by CALLBACK_POLICY_RETRY, run it now without backoff */
+  node->retry_at = 0;
+  InvokeCallback(node, arg);
+  return (node->status < 1);
+}
+
+static int ExecuteCallbacksFailFast(void *arg,
+                                    const struct CALLBACK_SELECTOR *sel) {
+  TCH_LOG(LOG_ALWAYS, "CallbackExecutionPolicy: ExecuteCallbacksFailFast\n");
+  struct CALLBACK_NODE *node;
+  int ret;
+  FOREACH_SELECTED(node, sel) {
+    if (node->retry_at && IsSelected(node, sel)) {
+      if ((ret = ExecuteScheduledRetry(node, arg)) < 1) return ret;
+    } else if (SHOULD_EXECUTE(node, sel)) {
+      if ((ret = ExecuteCallback(node, arg)) < 1) return ret;
+    }
+  }
+  return 1;
+}
+
+static int ExecuteCallbacksExecuteAll(void *arg,
+                                      const struct CALLBACK_SELECTOR *sel) {
   TCH_LOG(LOG_ALWAYS, "CallbackExecutionPolicy: ExecuteCallbacksExecuteAll\n");
   struct CALLBACK_NODE *node;
-  struct CALLBACK_NODE *stack = GetStack();
   int errors = 0;
-  FOREACH_NODE(node, stack) {
-    if (SHOULD_EXECUTE(node, id)) {
+  FOREACH_SELECTED(node, sel) {
+    if (node->retry_at && IsSelected(node, sel)) {
+      errors += ExecuteScheduledRetry(node, arg);
+    } else if (SHOULD_EXECUTE(node, sel)) {
       errors += ExecuteCallback(node, arg);
     }
   }
   return errors;
 }
 
-// END 
\ No newline at end of file
+static int ScheduleRetry(struct CALLBACK_NODE *node) {
+  int max_attempts = node->max_attempts ?: CALLBACK_RETRY_DEFAULT_ATTEMPTS;
+  unsigned long backoff_ms = node->backoff_ms ?: CALLBACK_RETRY_DEFAULT_BACKOFF;
+  uint64_t delay;
+
+  if (node->status > 0 || node->attempts >= max_attempts) return 0;
+
+  /* Exponential backoff, randomized within [delay / 2, delay] */
+  delay = (uint64_t)backoff_ms * 1000000 << (node->attempts - 1);
+  if (delay > (uint64_t)CALLBACK_RETRY_MAX_BACKOFF * 1000000) {
+    delay = (uint64_t)CALLBACK_RETRY_MAX_BACKOFF * 1000000;
+  }
+  if (state.jitter == 0) state.jitter = (unsigned int)MonotonicNs() | 1;
+  delay = delay / 2 + rand_r(&state.jitter) % (delay / 2 + 1);
+  node->retry_at = MonotonicNs() + delay;
+  return 1;
+}
+
+static int ExecuteCallbacksRetry(void *arg,
+                                 const struct CALLBACK_SELECTOR *sel) {
+  TCH_LOG(LOG_ALWAYS, "CallbackExecutionPolicy: ExecuteCallbacksRetry\n");
+  struct CALLBACK_NODE *node;
+  uint64_t now = MonotonicNs();
+  int errors = 0;
+
+  /* Never wait for a backoff here: the stack is locked. Failures keep
+   * their retry_at and are retried by the first pass after it. */
+  FOREACH_SELECTED(node, sel) {
+    if (node->retry_at && IsSelected(node, sel)) {
+      if (node->retry_at > now) continue;
+      node->retry_at = 0;
+      InvokeCallback(node, arg);
+    } else if (!SHOULD_EXECUTE(node, sel) || !ExecuteCallback(node, arg)) {
+      continue;
+    }
+    if (node->status < 1 && !ScheduleRetry(node)) {
+      /* Out of attempts */
+      errors++;
+    }
+  }
+  return errors;
+}
+
+// END
\ No newline at end of file
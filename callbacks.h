@@ -1,6 +1,7 @@
 #ifndef CALLBACK_REGISTRY_H
 #define CALLBACK_REGISTRY_H
 
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
@@ -13,7 +14,7 @@
  */
 typedef int (*CALLBACK_FUNC)(void*);
 
-/// Maximum allowed size for a callback name
+/// Maximum allowed size for a callback name. Longer names are truncated.
 #define MAXSIZENAME 128
 
 
@@ -25,11 +26,97 @@ enum CALLBACK_EXEC_POLICY {
                                      If nothing failed, return 1, otherwise return the 
                                      error code from the failing callback */
 
+  CALLBACK_POLICY_RETRY,          /* Execute all callbacks and schedule a retry with
+                                     exponential backoff for the failing ones, up to
+                                     their maximum number of attempts. A pass never
+                                     waits for a backoff: retries that are due run on
+                                     the next pass, see GetCallbackRetryDelay. Return
+                                     the number of callbacks that failed all their
+                                     attempts. Retries still scheduled when switching
+                                     to another policy run on its next pass. Scheduled
+                                     retries are not pending callbacks: event loops
+                                     must wake up after GetCallbackRetryDelay */
+
 };
 
+/// Maximum number of attempts under CALLBACK_POLICY_RETRY
+#define CALLBACK_MAX_ATTEMPTS 8
+#define CALLBACK_RETRY_DEFAULT_ATTEMPTS 3
+#define CALLBACK_RETRY_DEFAULT_BACKOFF 10     // ms before the first retry
+#define CALLBACK_RETRY_MAX_BACKOFF 1000       // ms, cap for the backoff
+
 #define CALLBACK_FAILURE    0   // Something went wrong during callback setup 
 #define CALLBACK_LOCKED    -1   // The underlying datastructure cannot be changed
 #define CALLBACK_SUCCESS    1   // The operation succedded
+#define CALLBACK_LIMIT     -2   // Too many callbacks registered
+
+/**
+ * @brief Memory held by the registry, see GetCallbackMemoryStats.
+ */
+struct CALLBACK_MEMORY_STATS {
+  int nodes;              /* Registered callbacks */
+  int peak_nodes;         /* Highest number of registered callbacks */
+  int pooled_nodes;       /* Released callbacks kept for reuse */
+  size_t bytes;           /* Bytes currently in use */
+  size_t peak_bytes;      /* Highest number of bytes in use */
+};
+
+/**
+ * @brief Aggregated statistics of all callbacks sharing a name.
+ */
+struct CALLBACK_STATS {
+  int registered;         /* Number of callbacks registered with the name */
+  int pending;            /* Number of those waiting to be executed */
+  int total_executions;   /* Sum of executions over all of them */
+  int failed;             /* Number of them whose last execution failed */
+};
+
+/**
+ * @brief Description of a callback that ran past its deadline.
+ */
+struct CALLBACK_OVERRUN {
+  int id;                     /* Id of the overrunning callback */
+  unsigned long deadline_ms;  /* Its deadline */
+  unsigned long elapsed_ms;   /* How long it had been running when detected */
+  char name[MAXSIZENAME];     /* Its name */
+};
+
+#define CALLBACK_STATS_MAGIC  0x53424b43  // "CKBS": file holds exported stats
+#define CALLBACK_STATS_VERSION 1
+#define CALLBACK_STATS_READ_ATTEMPTS 64
+
+/**
+ * @brief Statistics of one callback as exported to shared memory.
+ * The registry updates a slot with a seqlock: seq is odd while an update
+ * is in progress. Use ReadCallbackStatsSlot to get a consistent copy.
+ */
+struct CALLBACK_STATS_SLOT {
+  uint32_t seq;               /* Incremented before and after each update */
+  uint32_t in_use;            /* Does this slot describe a callback? */
+  int32_t id;                 /* Id of the callback */
+  int32_t last_status;        /* Status returned by its last execution */
+  uint64_t executions;        /* Times it has been executed */
+  uint64_t failures;          /* Times it returned zero or negative */
+  uint64_t total_ns;          /* Cumulative execution time */
+  char name[MAXSIZENAME];     /* Name of the callback */
+};
+
+/**
+ * @brief Layout of a statistics file written by EnableCallbackStatsExport.
+ */
+struct CALLBACK_STATS_HEADER {
+  uint32_t magic;             /* CALLBACK_STATS_MAGIC once initialized */
+  uint32_t version;           /* CALLBACK_STATS_VERSION */
+  uint32_t nslots;            /* Number of slots that follow */
+  uint32_t dropped;           /* Callbacks not exported for lack of slots */
+  struct CALLBACK_STATS_SLOT slots[];
+};
+
+/**
+ * @brief Type of the hook invoked, from the watchdog thread,
+ * whenever a callback overruns its deadline.
+ */
+typedef void (*CALLBACK_OVERRUN_HOOK)(const struct CALLBACK_OVERRUN *);
 
 /**
  * @brief Register a new callback function to be called. 
@@ -41,7 +128,8 @@ enum CALLBACK_EXEC_POLICY {
  * @param callback The callback function
  * @param arg Pointer to the arguments
  * @param name A nice name for the callback
- * @return Return CALLBACK_SUCCESS, CALLBACK_FAILURE or CALLBACK_LOCKED
+ * @return Return CALLBACK_SUCCESS, CALLBACK_FAILURE, CALLBACK_LOCKED
+ * or CALLBACK_LIMIT
  */
 int RegisterCallback(CALLBACK_FUNC callback, const char *name, void *arg);
 
@@ -61,7 +149,8 @@ int RegisterCallback(CALLBACK_FUNC callback, const char *name, void *arg);
  * @param arg Pointer to the arguments
  * @param name A nice name for the callback
  * @param id The nonzero value to be used as id for this callback.
- * @return Return CALLBACK_SUCCESS, CALLBACK_FAILURE or CALLBACK_LOCKED
+ * @return Return CALLBACK_SUCCESS, CALLBACK_FAILURE, CALLBACK_LOCKED
+ * or CALLBACK_LIMIT
  */
 int RegisterCallbackWithId(CALLBACK_FUNC callback, const char *name, void *arg, int id);
 
@@ -93,11 +182,288 @@ int ExecuteCallbacks(void* arg);
  */
 int ExecuteCallbacksWithId(void* arg, int id);
 
+/**
+ * @brief Execute the callbacks with a negative id from a signal handler.
+ * This function is async-signal-safe: it never blocks nor allocates,
+ * and works on a snapshot taken whenever callbacks with a negative id are
+ * registered or unregistered. It may interrupt any other function of the
+ * registry, including a running ExecuteCallbacks, and may itself be
+ * interrupted by another handler calling it. A callback with a negative id
+ * runs at most once until it re-registers itself, whether through this
+ * function or ExecuteCallbacksWithId: a handler interrupting it never runs
+ * it again, and rebuilding the snapshot keeps what already ran. Callbacks
+ * run from here can't re-register themselves: ReRegisterItself fails.
+ *
+ * @param arg Pointer to argument, for callbacks registered without one
+ * @param id The negative id representing the callbacks, or 0 for all
+ * callbacks with a negative id
+ * @return Return the number of callbacks that didn't succeed.
+ */
+int ExecuteEmergencyCallbacks(void* arg, int id);
+
+/**
+ * @brief Execute all nonexecuted registered callbacks with the given name
+ * whose ID is either a positive value or the default ID. As with
+ * ExecuteCallbacks, callbacks with a negative ID are never selected.
+ * Names are interned by the registry, so only the matching callbacks
+ * are visited.
+ *
+ * @param arg Pointer to argument
+ * @param name The name the callbacks were registered with
+ * @return Return the number of callbacks that didn't succeed.
+ */
+int ExecuteCallbacksByName(void* arg, const char *name);
+
+/**
+ * @brief Collect statistics for all callbacks registered with the given name.
+ *
+ * @param name The name the callbacks were registered with
+ * @param stats Where to store the statistics
+ * @return Return CALLBACK_SUCCESS, CALLBACK_FAILURE if no callback
+ * has that name, or CALLBACK_LOCKED
+ */
+int GetCallbackStatsByName(const char *name, struct CALLBACK_STATS *stats);
+
+/**
+ * @brief Mark the callbacks of an id as needing execution, without
+ * executing them. This is a single atomic operation in the common case
+ * and can be called from any thread, including from a callback.
+ * Triggering an id that is already triggered has no further effect.
+ * As with ExecuteCallbacksWithId, id 0 stands for ExecuteCallbacks.
+ *
+ * @param id The id representing the callbacks
+ * @return Return CALLBACK_SUCCESS, or CALLBACK_FAILURE if too many
+ * distinct ids are waiting for RunTriggeredCallbacks
+ */
+int TriggerCallbacks(int id);
+
+/**
+ * @brief Execute, in a single pass, the nonexecuted callbacks of every
+ * id triggered since the last call. Ids triggered while the pass is
+ * running are handled by exactly one follow-up pass before returning.
+ * Anything triggered during the follow-up pass is left for the next call.
+ * Meant to be called by a single executor thread.
+ *
+ * @param arg Pointer to argument
+ * @return Return the number of callbacks that didn't succeed,
+ * or CALLBACK_LOCKED, in which case triggers are kept for the next call.
+ */
+int RunTriggeredCallbacks(void* arg);
+
+/**
+ * @brief Get an eventfd that is readable while something has been
+ * triggered since the last RunTriggeredCallbacks, so that the executor
+ * thread can wait for triggers instead of polling. Only the first trigger
+ * after a drain writes to it. Do not read from it: RunTriggeredCallbacks
+ * drains it. The descriptor is owned by the registry and stays valid
+ * across ReleaseCallbacks, which discards pending triggers, until
+ * CloseCallbackEventFds.
+ *
+ * @return Return the file descriptor, CALLBACK_FAILURE or CALLBACK_LOCKED
+ */
+int GetTriggerEventFd();
+
 /**
  * @brief Release all the resources and empty the stack of callbacks. 
+ * Event file descriptors stay open and are drained, see
+ * CloseCallbackEventFds.
+ * The memory of a bounded number of callbacks is kept for reuse,
+ * see ShrinkCallbacks.
  */
 void ReleaseCallbacks();
 
+/**
+ * @brief Limit the number of registered callbacks. Once reached,
+ * registering returns CALLBACK_LIMIT.
+ *
+ * @param max_callbacks The limit, 0 for no limit
+ * @param old_limit Optional, receives the limit previously used
+ * @return Return CALLBACK_SUCCESS, CALLBACK_FAILURE if max_callbacks is
+ * negative, or CALLBACK_LOCKED
+ */
+int SetCallbackLimit(int max_callbacks, int *old_limit);
+
+/**
+ * @brief Get the memory held by the registry, including the callbacks
+ * kept for reuse and the name and id tables.
+ *
+ * @param stats Where to store the statistics
+ * @return Return CALLBACK_SUCCESS, CALLBACK_FAILURE or CALLBACK_LOCKED
+ */
+int GetCallbackMemoryStats(struct CALLBACK_MEMORY_STATS *stats);
+
+/**
+ * @brief Get the memory held by the callbacks of the specified id.
+ * As with ExecuteCallbacksWithId, id 0 stands for all callbacks run by
+ * ExecuteCallbacks. Peaks are kept until ReleaseCallbacks.
+ *
+ * @param id The id representing the callbacks
+ * @param stats Where to store the statistics
+ * @return Return CALLBACK_SUCCESS, CALLBACK_FAILURE or CALLBACK_LOCKED
+ */
+int GetCallbackMemoryStatsWithId(int id, struct CALLBACK_MEMORY_STATS *stats);
+
+/**
+ * @brief Give the memory of released callbacks back to the system.
+ * Ids are kept in a table until ShrinkCallbacks or ReleaseCallbacks,
+ * which forget those without registered callbacks or eventfd. Callers
+ * registering and unregistering ever new ids should call it from time
+ * to time.
+ *
+ * @return Return CALLBACK_SUCCESS or CALLBACK_LOCKED
+ */
+int ShrinkCallbacks();
+
+
+/**
+ * @brief Check if there are nonexecuted callbacks for the specified id.
+ * As with ExecuteCallbacksWithId, id 0 stands for all callbacks run by
+ * ExecuteCallbacks. Retries scheduled by CALLBACK_POLICY_RETRY are not
+ * counted, nor do they make the eventfd readable: use
+ * GetCallbackRetryDelay as the timeout of the event loop.
+ *
+ * @param id The id representing the callbacks
+ * @return Return 1 if there is something to execute, 0 if not,
+ * or CALLBACK_LOCKED
+ */
+int HasPendingCallbacks(int id);
+
+/**
+ * @brief Get an eventfd that is readable while there are nonexecuted
+ * callbacks for the specified id, either newly registered or rearmed by
+ * ReRegisterItself. It can be added to an epoll set so that
+ * ExecuteCallbacksWithId is only called when there is work to do.
+ * Do not read from it: it is drained once everything has been executed.
+ * The descriptor is owned by the registry and stays valid across
+ * ReleaseCallbacks, until CloseCallbackEventFds.
+ *
+ * @param id The id representing the callbacks, 0 as in ExecuteCallbacks
+ * @return Return the file descriptor, CALLBACK_FAILURE or CALLBACK_LOCKED
+ */
+int GetCallbackEventFd(int id);
+
+/**
+ * @brief Close every eventfd returned by GetCallbackEventFd and
+ * GetTriggerEventFd. Later calls to them return new descriptors.
+ * Only call it once no thread waits on them nor triggers callbacks.
+ *
+ * @return Return CALLBACK_SUCCESS or CALLBACK_LOCKED
+ */
+int CloseCallbackEventFds();
+
+/**
+ * @brief Publish per-callback statistics into a memory-mapped file so
+ * that external tools can sample them without stopping the process.
+ * Each registered callback takes a slot until it is unregistered or
+ * released. Counters start at zero when the slot is taken, even for
+ * callbacks that already ran before the export was enabled. Callbacks
+ * registered once all slots are taken are not exported and only counted
+ * in the header.
+ *
+ * @param path File to create or truncate
+ * @param max_callbacks Number of slots in the file
+ * @return Return CALLBACK_SUCCESS, CALLBACK_FAILURE or CALLBACK_LOCKED
+ */
+int EnableCallbackStatsExport(const char *path, int max_callbacks);
+
+/**
+ * @brief Stop publishing statistics. The file is left in place.
+ *
+ * @return Return CALLBACK_SUCCESS or CALLBACK_LOCKED
+ */
+int DisableCallbackStatsExport();
+
+/**
+ * @brief Take a consistent copy of an exported slot. This never blocks
+ * the process writing the statistics.
+ *
+ * @param slot The slot in the mapped file
+ * @param snapshot Where to store the copy
+ * @return Return CALLBACK_SUCCESS, or CALLBACK_LOCKED if the slot kept
+ * changing for CALLBACK_STATS_READ_ATTEMPTS attempts
+ */
+int ReadCallbackStatsSlot(const struct CALLBACK_STATS_SLOT *slot,
+                          struct CALLBACK_STATS_SLOT *snapshot);
+
+/**
+ * @brief Set a deadline for a callback. If the callback has been added
+ * multiple times, only the most recent insertion is affected.
+ * Deadlines are only enforced while the watchdog is running.
+ *
+ * @param callback The callback
+ * @param deadline_ms Maximum execution time in ms, zero to disable
+ * @return Return CALLBACK_SUCCESS, CALLBACK_FAILURE or CALLBACK_LOCKED
+ */
+int SetCallbackDeadline(CALLBACK_FUNC callback, unsigned long deadline_ms);
+
+/**
+ * @brief Configure how a callback is retried under CALLBACK_POLICY_RETRY.
+ * If the callback has been added multiple times, only the most recent
+ * insertion is affected. The n-th retry waits backoff_ms * 2^(n-1) ms,
+ * capped to CALLBACK_RETRY_MAX_BACKOFF and randomized down to half of it.
+ *
+ * @param callback The callback
+ * @param max_attempts Total attempts, up to CALLBACK_MAX_ATTEMPTS,
+ * 0 for CALLBACK_RETRY_DEFAULT_ATTEMPTS
+ * @param backoff_ms Delay before the first retry,
+ * 0 for CALLBACK_RETRY_DEFAULT_BACKOFF
+ * @return Return CALLBACK_SUCCESS, CALLBACK_FAILURE or CALLBACK_LOCKED
+ */
+int SetCallbackRetry(CALLBACK_FUNC callback, int max_attempts,
+                     unsigned long backoff_ms);
+
+/**
+ * @brief Get how long until the earliest scheduled retry is due, that is,
+ * when to run the next pass under CALLBACK_POLICY_RETRY.
+ *
+ * @param delay_ms Where to store the delay in ms, 0 if already due
+ * @return Return CALLBACK_SUCCESS, CALLBACK_FAILURE if no retry is
+ * scheduled, or CALLBACK_LOCKED
+ */
+int GetCallbackRetryDelay(unsigned long *delay_ms);
+
+/**
+ * @brief Get the attempts made by the last execution of a callback.
+ * If the callback has been added multiple times, the most recent
+ * insertion is used.
+ *
+ * @param callback The callback
+ * @param statuses Optional array receiving the status of each attempt
+ * @param size Number of elements in statuses, must not be negative
+ * @return Return the number of attempts, CALLBACK_FAILURE if the callback
+ * isn't registered or size is negative, or CALLBACK_LOCKED
+ */
+int GetCallbackAttempts(CALLBACK_FUNC callback, int *statuses, int size);
+
+/**
+ * @brief Start a watchdog thread that reports callbacks running past
+ * their deadline. The watchdog only reports: the overrunning callback
+ * keeps running. Its clock ticks every period_ms, which is also the
+ * precision of the measured execution time.
+ *
+ * @param period_ms Interval between checks, must be nonzero
+ * @param hook Optional function called for every overrun
+ * @return Return CALLBACK_SUCCESS or CALLBACK_FAILURE
+ */
+int StartCallbackWatchdog(unsigned long period_ms, CALLBACK_OVERRUN_HOOK hook);
+
+/**
+ * @brief Stop the watchdog thread, if running.
+ */
+void StopCallbackWatchdog();
+
+/**
+ * @brief Get the number of overruns reported by the watchdog so far.
+ */
+unsigned long GetCallbackOverrunCount();
+
+/**
+ * @brief Get the most recent overrun reported by the watchdog.
+ *
+ * @param overrun Where to store the overrun
+ * @return Return CALLBACK_SUCCESS or CALLBACK_FAILURE if nothing overran
+ */
+int GetLastCallbackOverrun(struct CALLBACK_OVERRUN *overrun);
 
 /**
  * @brief Function to check if a given function was called natively
@@ -111,7 +477,8 @@ int IsRunningAsCallback();
 /**
  * @brief This Function can be called by a callback to register itself
  * to be executed again. However, this will depend on ExecuteCallbacks 
- * being called a second time.
+ * being called a second time. It fails when called from a callback run
+ * by ExecuteEmergencyCallbacks.
  * 
  * @return Return CALLBACK_SUCCESS or CALLBACK_FAILURE
  */
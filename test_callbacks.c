@@ -1,3 +1,11 @@
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
 #include "callbacks.h"
 #include "unittest.h"
 
@@ -32,6 +40,83 @@ int evil_callback(void* state) {
   return 1;
 }
 
+int slow_callback(void* state) {
+  struct timespec ts = {0, 50 * 1000000};
+  nanosleep(&ts, NULL);
+  return 1;
+}
+
+static struct CALLBACK_OVERRUN hooked_overrun;
+static int hooked_overruns;
+
+void overrun_hook(const struct CALLBACK_OVERRUN* overrun) {
+  hooked_overrun = *overrun;
+  hooked_overruns++;
+}
+
+static void* StartWatchdog(void* started) {
+  if (StartCallbackWatchdog(1, NULL) == CALLBACK_SUCCESS) {
+    __atomic_add_fetch((int*)started, 1, __ATOMIC_SEQ_CST);
+  }
+  return NULL;
+}
+
+int rearming_callback(void* state) {
+  ReRegisterItself();
+  return 1;
+}
+
+static int IsReadable(int fd) {
+  struct pollfd pfd = {fd, POLLIN, 0};
+  return poll(&pfd, 1, 0) == 1;
+}
+
+static int flaky_failures;
+static int flaky_order;
+
+int flaky_callback(void* state) {
+  flaky_order = generator++;
+  return flaky_failures-- > 0 ? -1 : 1;
+}
+
+int retriggering_callback(void* state) {
+  int* passes = (int*)state;
+  if ((*passes)++ == 0) {
+    ReRegisterItself();
+    TriggerCallbacks(3);
+    TriggerCallbacks(3);
+  }
+  return 1;
+}
+
+static int emergency_failures;
+
+void EmergencyHandler(int signum) {
+  emergency_failures = ExecuteEmergencyCallbacks(NULL, -1);
+}
+
+static int interrupted_calls;
+
+int interrupted_callback(void* state) {
+  interrupted_calls++;
+  raise(SIGUSR1);
+  return 1;
+}
+
+static int emergency_rearm_status;
+
+int emergency_rearming_callback(void* state) {
+  emergency_rearm_status = ReRegisterItself();
+  return 1;
+}
+
+int always_retriggering_callback(void* state) {
+  (*(int*)state)++;
+  ReRegisterItself();
+  TriggerCallbacks(3);
+  return 1;
+}
+
 UNITTEST_TEST_SUITE_SETUP(CallbackSuite) {
   // NOOP
 }
@@ -168,6 +253,536 @@ UNITTEST_TEST_CASE(CallbackSuite, UnregisteredCallbacksArentExecuted) {
   UNITTEST_ASSERT(_CALLBACK_COUNT(func2) == 1);
 }
 
+UNITTEST_TEST_CASE(CallbackSuite, CanExecuteCallbacksByName) {
+  RegisterCallbackWithId(func1, "shared", NULL, 10);
+  RegisterCallbackWithId(func2, "shared", NULL, -3);
+  RegisterCallback(func3, "other", NULL);
+
+  _CALLBACK_COUNT(func1) = 0;
+  _CALLBACK_COUNT(func2) = 0;
+  _CALLBACK_COUNT(func3) = 0;
+
+  ExecuteCallbacksByName(NULL, "missing");
+  ExecuteCallbacksByName(NULL, "shared");
+
+  UNITTEST_ASSERT(_CALLBACK_COUNT(func1) == 1);
+  UNITTEST_ASSERT_(_CALLBACK_COUNT(func2) == 0,
+                   "Negative ids need an explicit id");
+  UNITTEST_ASSERT(_CALLBACK_COUNT(func3) == 0);
+}
+
+UNITTEST_TEST_CASE(CallbackSuite, CanGetCallbackStatsByName) {
+  struct CALLBACK_STATS stats;
+  RegisterCallback(func1, "shared", NULL);
+  RegisterCallback(func2, "shared", NULL);
+  RegisterCallback(func3, "shared", NULL);
+  UnregisterCallback(func3);
+
+  _CALLBACK_RETVAL(func1) = 1;
+  _CALLBACK_RETVAL(func2) = 0;
+  ExecuteCallbacks(NULL);
+  RegisterCallback(func4, "shared", NULL);
+
+  UNITTEST_ASSERT(GetCallbackStatsByName("missing", &stats) ==
+                  CALLBACK_FAILURE);
+  UNITTEST_ASSERT(GetCallbackStatsByName("shared", &stats) ==
+                  CALLBACK_SUCCESS);
+  UNITTEST_ASSERT(stats.registered == 3);
+  UNITTEST_ASSERT(stats.pending == 1);
+  UNITTEST_ASSERT(stats.total_executions == 2);
+  UNITTEST_ASSERT(stats.failed == 1);
+}
+
+UNITTEST_TEST_CASE(CallbackSuite, UnregisteredNamesAreForgotten) {
+  struct CALLBACK_STATS stats;
+  RegisterCallback(func1, "func1", NULL);
+  UnregisterCallback(func1);
+
+  UNITTEST_ASSERT(GetCallbackStatsByName("func1", &stats) ==
+                  CALLBACK_FAILURE);
+
+  RegisterCallback(func2, "func2", NULL);
+  UNITTEST_ASSERT(GetCallbackStatsByName("func2", &stats) ==
+                  CALLBACK_SUCCESS);
+  UNITTEST_ASSERT(stats.registered == 1);
+}
+
+UNITTEST_TEST_CASE(CallbackSuite, WatchdogReportsOverrunningCallbacks) {
+  struct CALLBACK_OVERRUN overrun;
+  unsigned long overruns = GetCallbackOverrunCount();
+  RegisterCallbackWithId(slow_callback, "slow", NULL, 7);
+  RegisterCallback(func1, "fast", NULL);
+  UNITTEST_ASSERT(SetCallbackDeadline(slow_callback, 10) == CALLBACK_SUCCESS);
+  UNITTEST_ASSERT(SetCallbackDeadline(func1, 10) == CALLBACK_SUCCESS);
+  UNITTEST_ASSERT(SetCallbackDeadline(func2, 10) == CALLBACK_FAILURE);
+
+  hooked_overruns = 0;
+  UNITTEST_ASSERT(StartCallbackWatchdog(1, overrun_hook) == CALLBACK_SUCCESS);
+  ExecuteCallbacks(NULL);
+  ExecuteCallbacksWithId(NULL, 7);
+  StopCallbackWatchdog();
+
+  UNITTEST_ASSERT(GetCallbackOverrunCount() == overruns + 1);
+  UNITTEST_ASSERT(hooked_overruns == 1);
+  UNITTEST_ASSERT(GetLastCallbackOverrun(&overrun) == CALLBACK_SUCCESS);
+  UNITTEST_ASSERT(overrun.id == 7);
+  UNITTEST_ASSERT(overrun.elapsed_ms > 10);
+  UNITTEST_ASSERT(strcmp(overrun.name, "slow") == 0);
+  UNITTEST_ASSERT(strcmp(hooked_overrun.name, "slow") == 0);
+}
+
+UNITTEST_TEST_CASE(CallbackSuite, WatchdogStartsOnlyOnce) {
+  pthread_t threads[4];
+  int started = 0;
+  int i;
+  for (i = 0; i < 4; i++) {
+    pthread_create(&threads[i], NULL, StartWatchdog, &started);
+  }
+  for (i = 0; i < 4; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  UNITTEST_ASSERT(started == 1);
+  StopCallbackWatchdog();
+  UNITTEST_ASSERT(StartCallbackWatchdog(1, NULL) == CALLBACK_SUCCESS);
+  StopCallbackWatchdog();
+}
+
+UNITTEST_TEST_CASE(CallbackSuite, CanCheckPendingCallbacks) {
+  UNITTEST_ASSERT(HasPendingCallbacks(0) == 0);
+  RegisterCallbackWithId(func1, "func1", NULL, 10);
+  RegisterCallbackWithId(func2, "func2", NULL, -10);
+
+  UNITTEST_ASSERT(HasPendingCallbacks(0) == 1);
+  UNITTEST_ASSERT(HasPendingCallbacks(10) == 1);
+  UNITTEST_ASSERT(HasPendingCallbacks(-10) == 1);
+  UNITTEST_ASSERT(HasPendingCallbacks(20) == 0);
+
+  ExecuteCallbacks(NULL);
+  UNITTEST_ASSERT(HasPendingCallbacks(0) == 0);
+  UNITTEST_ASSERT(HasPendingCallbacks(10) == 0);
+  UNITTEST_ASSERT(HasPendingCallbacks(-10) == 1);
+
+  UnregisterCallback(func2);
+  UNITTEST_ASSERT(HasPendingCallbacks(-10) == 0);
+}
+
+UNITTEST_TEST_CASE(CallbackSuite, EventFdIsReadableWhilePending) {
+  int fd = GetCallbackEventFd(0);
+  int id_fd = GetCallbackEventFd(-5);
+  UNITTEST_ASSERT(fd >= 0);
+  UNITTEST_ASSERT(id_fd >= 0);
+  UNITTEST_ASSERT(!IsReadable(fd));
+
+  RegisterCallback(rearming_callback, "rearming", NULL);
+  RegisterCallbackWithId(func1, "func1", NULL, -5);
+  UNITTEST_ASSERT(IsReadable(fd));
+  UNITTEST_ASSERT(IsReadable(id_fd));
+
+  ExecuteCallbacksWithId(NULL, -5);
+  UNITTEST_ASSERT(!IsReadable(id_fd));
+
+  ExecuteCallbacks(NULL);
+  UNITTEST_ASSERT(IsReadable(fd));
+  UnregisterCallback(rearming_callback);
+  UNITTEST_ASSERT(!IsReadable(fd));
+
+  /* Releasing keeps the descriptors callers may still be watching */
+  RegisterCallbackWithId(func1, "func1", NULL, -5);
+  ReleaseCallbacks();
+  UNITTEST_ASSERT(fcntl(id_fd, F_GETFD) != -1);
+  UNITTEST_ASSERT(!IsReadable(id_fd));
+  UNITTEST_ASSERT(GetCallbackEventFd(-5) == id_fd);
+  UNITTEST_ASSERT(GetCallbackEventFd(0) == fd);
+  RegisterCallbackWithId(func1, "func1", NULL, -5);
+  UNITTEST_ASSERT(IsReadable(id_fd));
+
+  UNITTEST_ASSERT(CloseCallbackEventFds() == CALLBACK_SUCCESS);
+  UNITTEST_ASSERT(fcntl(id_fd, F_GETFD) == -1);
+}
+
+UNITTEST_TEST_CASE(CallbackSuite, CanExportStatsToSharedMemory) {
+  char path[] = "/tmp/callback_stats_XXXXXX";
+  struct CALLBACK_STATS_HEADER* header;
+  struct CALLBACK_STATS_SLOT snapshot;
+  size_t size;
+  int fd = mkstemp(path);
+  uint32_t i;
+  int found = 0;
+  UNITTEST_ASSERT(fd >= 0);
+  close(fd);
+
+  RegisterCallbackWithId(func5, "prerun", NULL, 6);
+  _CALLBACK_RETVAL(func5) = 1;
+  ExecuteCallbacksWithId(NULL, 6);
+  RegisterCallbackWithId(func1, "exported", NULL, 4);
+  UNITTEST_ASSERT(EnableCallbackStatsExport(path, 2) == CALLBACK_SUCCESS);
+  RegisterCallback(func2, "func2", NULL);
+  RegisterCallback(func3, "func3", NULL);
+
+  _CALLBACK_RETVAL(func1) = 0;
+  ExecuteCallbacksWithId(NULL, 4);
+
+  size = sizeof(*header) + 2 * sizeof(struct CALLBACK_STATS_SLOT);
+  fd = open(path, O_RDONLY);
+  header = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  unlink(path);
+  UNITTEST_ASSERT(header != MAP_FAILED);
+  UNITTEST_ASSERT(header->magic == CALLBACK_STATS_MAGIC);
+  UNITTEST_ASSERT(header->nslots == 2);
+  UNITTEST_ASSERT(header->dropped == 2);
+
+  for (i = 0; i < header->nslots; i++) {
+    UNITTEST_ASSERT(ReadCallbackStatsSlot(&header->slots[i], &snapshot) ==
+                    CALLBACK_SUCCESS);
+    if (snapshot.in_use && strcmp(snapshot.name, "exported") == 0) {
+      found = 1;
+      UNITTEST_ASSERT(snapshot.id == 4);
+      UNITTEST_ASSERT(snapshot.executions == 1);
+      UNITTEST_ASSERT(snapshot.failures == 1);
+      UNITTEST_ASSERT(snapshot.last_status == 0);
+    }
+    if (snapshot.in_use && strcmp(snapshot.name, "prerun") == 0) {
+      /* Ran before the export was enabled */
+      UNITTEST_ASSERT(snapshot.executions == 0);
+      UNITTEST_ASSERT(snapshot.failures == 0);
+    }
+  }
+  UNITTEST_ASSERT(found);
+  munmap(header, size);
+  UNITTEST_ASSERT(DisableCallbackStatsExport() == CALLBACK_SUCCESS);
+}
+
+static int RunRetries(void) {
+  unsigned long delay_ms;
+  struct timespec ts;
+  int errors = 0;
+  while (GetCallbackRetryDelay(&delay_ms) == CALLBACK_SUCCESS) {
+    ts.tv_sec = delay_ms / 1000;
+    ts.tv_nsec = (delay_ms % 1000) * 1000000;
+    nanosleep(&ts, NULL);
+    errors += ExecuteCallbacks(NULL);
+  }
+  return errors;
+}
+
+UNITTEST_TEST_CASE(CallbackSuite, RetryPolicyRetriesFailingCallbacks) {
+  int statuses[CALLBACK_MAX_ATTEMPTS];
+  unsigned long delay_ms;
+  int old_policy = SetCallbackExecutionPolicy(CALLBACK_POLICY_RETRY);
+  RegisterCallback(func1, "func1", NULL);
+  RegisterCallback(flaky_callback, "flaky", NULL);
+  SetCallbackRetry(flaky_callback, 4, 20);
+
+  flaky_failures = 2;
+  _CALLBACK_RETVAL(func1) = 1;
+  _CALLBACK_COUNT(func1) = 0;
+  generator = 1;
+  UNITTEST_CHECK(ExecuteCallbacks(NULL) == 0);
+  UNITTEST_CHECK_(flaky_order == 1, "The pass should not wait for retries");
+  UNITTEST_CHECK(_CALLBACK_ORDER(func1) == 2);
+  UNITTEST_CHECK(GetCallbackRetryDelay(&delay_ms) == CALLBACK_SUCCESS);
+  UNITTEST_CHECK(delay_ms > 0 && delay_ms <= 20);
+
+  /* Backoff not expired yet */
+  ExecuteCallbacks(NULL);
+  UNITTEST_CHECK(flaky_order == 1);
+
+  UNITTEST_CHECK(RunRetries() == 0);
+  SetCallbackExecutionPolicy(old_policy);
+
+  UNITTEST_ASSERT(_CALLBACK_COUNT(func1) == 1);
+  UNITTEST_ASSERT(flaky_order == 4);
+  UNITTEST_ASSERT(GetCallbackAttempts(flaky_callback, statuses,
+                                      CALLBACK_MAX_ATTEMPTS) == 3);
+  UNITTEST_ASSERT(statuses[0] == -1);
+  UNITTEST_ASSERT(statuses[1] == -1);
+  UNITTEST_ASSERT(statuses[2] == 1);
+}
+
+UNITTEST_TEST_CASE(CallbackSuite, RetryPolicyGivesUpAfterMaxAttempts) {
+  int old_policy = SetCallbackExecutionPolicy(CALLBACK_POLICY_RETRY);
+  RegisterCallback(flaky_callback, "flaky", NULL);
+  SetCallbackRetry(flaky_callback, 2, 1);
+
+  flaky_failures = 10;
+  UNITTEST_CHECK(ExecuteCallbacks(NULL) == 0);
+  UNITTEST_CHECK(RunRetries() == 1);
+  SetCallbackExecutionPolicy(old_policy);
+
+  UNITTEST_ASSERT(GetCallbackAttempts(flaky_callback, NULL, 0) == 2);
+  UNITTEST_ASSERT(GetCallbackAttempts(flaky_callback, (int*)&old_policy,
+                                      -1) == CALLBACK_FAILURE);
+  UNITTEST_ASSERT(SetCallbackRetry(flaky_callback, CALLBACK_MAX_ATTEMPTS + 1,
+                                   1) == CALLBACK_FAILURE);
+}
+
+UNITTEST_TEST_CASE(CallbackSuite, OtherPoliciesRunScheduledRetries) {
+  unsigned long delay_ms;
+  int old_policy = SetCallbackExecutionPolicy(CALLBACK_POLICY_RETRY);
+  RegisterCallback(flaky_callback, "flaky", NULL);
+  SetCallbackRetry(flaky_callback, 2, CALLBACK_RETRY_MAX_BACKOFF);
+
+  flaky_failures = 1;
+  generator = 1;
+  UNITTEST_CHECK(ExecuteCallbacks(NULL) == 0);
+  SetCallbackExecutionPolicy(old_policy);
+  UNITTEST_ASSERT(GetCallbackRetryDelay(&delay_ms) == CALLBACK_SUCCESS);
+
+  /* The retry runs right away instead of staying scheduled forever */
+  UNITTEST_ASSERT(ExecuteCallbacks(NULL) == 0);
+  UNITTEST_ASSERT(flaky_order == 2);
+  UNITTEST_ASSERT(GetCallbackRetryDelay(&delay_ms) == CALLBACK_FAILURE);
+}
+
+UNITTEST_TEST_CASE(CallbackSuite, CanRunTriggeredCallbacks) {
+  RegisterCallbackWithId(func1, "func1", NULL, 1);
+  RegisterCallbackWithId(func2, "func2", NULL, -2);
+  RegisterCallbackWithId(func3, "func3", NULL, 3);
+  RegisterCallback(func4, "func4", NULL);
+
+  _CALLBACK_COUNT(func1) = 0;
+  _CALLBACK_COUNT(func2) = 0;
+  _CALLBACK_COUNT(func3) = 0;
+  _CALLBACK_COUNT(func4) = 0;
+
+  UNITTEST_ASSERT(RunTriggeredCallbacks(NULL) == 0);
+  UNITTEST_ASSERT(_CALLBACK_COUNT(func1) == 0);
+
+  TriggerCallbacks(-2);
+  TriggerCallbacks(1);
+  TriggerCallbacks(-2);
+  RunTriggeredCallbacks(NULL);
+
+  UNITTEST_ASSERT(_CALLBACK_COUNT(func1) == 1);
+  UNITTEST_ASSERT(_CALLBACK_COUNT(func2) == 1);
+  UNITTEST_ASSERT(_CALLBACK_COUNT(func3) == 0);
+  UNITTEST_ASSERT(_CALLBACK_COUNT(func4) == 0);
+
+  TriggerCallbacks(0);
+  RunTriggeredCallbacks(NULL);
+  UNITTEST_ASSERT(_CALLBACK_COUNT(func3) == 1);
+  UNITTEST_ASSERT(_CALLBACK_COUNT(func4) == 1);
+}
+
+UNITTEST_TEST_CASE(CallbackSuite, TriggersDuringAPassRunOneFollowUpPass) {
+  int passes = 0;
+  RegisterCallbackWithId(retriggering_callback, "retriggering", &passes, 3);
+
+  TriggerCallbacks(3);
+  RunTriggeredCallbacks(NULL);
+
+  UNITTEST_ASSERT(passes == 2);
+  UNITTEST_ASSERT(HasPendingCallbacks(3) == 0);
+}
+
+UNITTEST_TEST_CASE(CallbackSuite, TriggersRunAtMostOneFollowUpPass) {
+  int passes = 0;
+  RegisterCallbackWithId(always_retriggering_callback, "retriggering",
+                         &passes, 3);
+
+  TriggerCallbacks(3);
+  RunTriggeredCallbacks(NULL);
+  UNITTEST_ASSERT(passes == 2);
+
+  /* The last trigger is kept for the next call */
+  RunTriggeredCallbacks(NULL);
+  UNITTEST_ASSERT(passes == 4);
+}
+
+UNITTEST_TEST_CASE(CallbackSuite, TriggerEventFdWakesTheExecutor) {
+  int fd = GetTriggerEventFd();
+  UNITTEST_ASSERT(fd >= 0);
+  RegisterCallbackWithId(func1, "func1", NULL, 1);
+  _CALLBACK_COUNT(func1) = 0;
+  UNITTEST_ASSERT(!IsReadable(fd));
+
+  TriggerCallbacks(1);
+  TriggerCallbacks(0);
+  UNITTEST_ASSERT(IsReadable(fd));
+  RunTriggeredCallbacks(NULL);
+  UNITTEST_ASSERT(!IsReadable(fd));
+  UNITTEST_ASSERT(_CALLBACK_COUNT(func1) == 1);
+
+  /* Releasing discards triggers, but keeps the descriptor */
+  TriggerCallbacks(1);
+  ReleaseCallbacks();
+  UNITTEST_ASSERT(!IsReadable(fd));
+  UNITTEST_ASSERT(GetTriggerEventFd() == fd);
+  RegisterCallbackWithId(func1, "func1", NULL, 1);
+  RunTriggeredCallbacks(NULL);
+  UNITTEST_ASSERT(_CALLBACK_COUNT(func1) == 1);
+}
+
+UNITTEST_TEST_CASE(CallbackSuite, CanLimitRegisteredCallbacks) {
+  int old_limit;
+  UNITTEST_ASSERT(SetCallbackLimit(-1, &old_limit) == CALLBACK_FAILURE);
+  UNITTEST_ASSERT(SetCallbackLimit(2, &old_limit) == CALLBACK_SUCCESS);
+  UNITTEST_ASSERT(old_limit == 0);
+  UNITTEST_CHECK(RegisterCallback(func1, "func1", NULL) == CALLBACK_SUCCESS);
+  UNITTEST_CHECK(RegisterCallbackWithId(func2, "func2", NULL, 5) ==
+                 CALLBACK_SUCCESS);
+  UNITTEST_CHECK(RegisterCallback(func3, "func3", NULL) == CALLBACK_LIMIT);
+  UnregisterCallback(func1);
+  UNITTEST_CHECK(RegisterCallback(func3, "func3", NULL) == CALLBACK_SUCCESS);
+  SetCallbackLimit(old_limit, NULL);
+}
+
+UNITTEST_TEST_CASE(CallbackSuite, CanAccountCallbackMemory) {
+  struct CALLBACK_MEMORY_STATS stats;
+  RegisterCallbackWithId(func1, "func1", NULL, 5);
+  RegisterCallbackWithId(func2, "func2", NULL, 5);
+  RegisterCallbackWithId(func3, "func3", NULL, -5);
+  UnregisterCallback(func2);
+
+  UNITTEST_ASSERT(GetCallbackMemoryStatsWithId(5, &stats) == CALLBACK_SUCCESS);
+  UNITTEST_ASSERT(stats.nodes == 1);
+  UNITTEST_ASSERT(stats.peak_nodes == 2);
+  UNITTEST_ASSERT(stats.bytes > 0);
+  UNITTEST_ASSERT(stats.peak_bytes == 2 * stats.bytes);
+
+  UNITTEST_ASSERT(GetCallbackMemoryStatsWithId(-5, &stats) ==
+                  CALLBACK_SUCCESS);
+  UNITTEST_ASSERT(stats.nodes == 1);
+
+  UNITTEST_ASSERT(GetCallbackMemoryStats(&stats) == CALLBACK_SUCCESS);
+  UNITTEST_ASSERT(stats.nodes == 2);
+  UNITTEST_ASSERT(stats.pooled_nodes >= 1);
+  UNITTEST_ASSERT(stats.bytes > 0);
+  UNITTEST_ASSERT(stats.peak_bytes >= stats.bytes);
+}
+
+UNITTEST_TEST_CASE(CallbackSuite, ShrinkReleasesPooledMemory) {
+  struct CALLBACK_MEMORY_STATS before, after;
+  int i;
+  for (i = 0; i < 1000; i++) RegisterCallback(func1, "func1", NULL);
+  ReleaseCallbacks();
+
+  GetCallbackMemoryStats(&before);
+  UNITTEST_ASSERT(before.nodes == 0);
+  UNITTEST_ASSERT(before.pooled_nodes > 0);
+  UNITTEST_ASSERT_(before.pooled_nodes < 1000, "The pool should be bounded");
+
+  UNITTEST_ASSERT(ShrinkCallbacks() == CALLBACK_SUCCESS);
+  GetCallbackMemoryStats(&after);
+  UNITTEST_ASSERT(after.pooled_nodes == 0);
+  UNITTEST_ASSERT(after.bytes == 0);
+}
+
+UNITTEST_TEST_CASE(CallbackSuite, ShrinkForgetsUnusedIds) {
+  struct CALLBACK_MEMORY_STATS before, after;
+  int i;
+  RegisterCallbackWithId(func1, "func1", NULL, 1);
+  for (i = 2; i < 1000; i++) {
+    RegisterCallbackWithId(func2, "func2", NULL, i);
+    UnregisterCallback(func2);
+  }
+
+  GetCallbackMemoryStats(&before);
+  UNITTEST_ASSERT(ShrinkCallbacks() == CALLBACK_SUCCESS);
+  GetCallbackMemoryStats(&after);
+  UNITTEST_ASSERT(after.bytes < before.bytes);
+
+  /* Ids still in use are kept */
+  UNITTEST_ASSERT(GetCallbackMemoryStatsWithId(1, &after) == CALLBACK_SUCCESS);
+  UNITTEST_ASSERT(after.nodes == 1);
+  UNITTEST_ASSERT(HasPendingCallbacks(1) == 1);
+  _CALLBACK_COUNT(func1) = 0;
+  _CALLBACK_RETVAL(func1) = 1;
+  UNITTEST_ASSERT(ExecuteCallbacksWithId(NULL, 1) == 0);
+  UNITTEST_ASSERT(_CALLBACK_COUNT(func1) == 1);
+  UNITTEST_ASSERT(HasPendingCallbacks(1) == 0);
+}
+
+UNITTEST_TEST_CASE(CallbackSuite, CanExecuteEmergencyCallbacksFromSignal) {
+  void (*old_handler)(int) = signal(SIGUSR1, EmergencyHandler);
+  RegisterCallbackWithId(func1, "func1", NULL, -1);
+  RegisterCallbackWithId(func2, "func2", NULL, -1);
+  RegisterCallbackWithId(func3, "func3", NULL, -2);
+  RegisterCallbackWithId(func4, "func4", NULL, -1);
+  UnregisterCallback(func4);
+  RegisterCallback(interrupted_callback, "interrupted", NULL);
+
+  _CALLBACK_COUNT(func1) = 0;
+  _CALLBACK_COUNT(func2) = 0;
+  _CALLBACK_COUNT(func3) = 0;
+  _CALLBACK_COUNT(func4) = 0;
+  _CALLBACK_RETVAL(func1) = 1;
+  _CALLBACK_RETVAL(func2) = 0;
+  _CALLBACK_RETVAL(func3) = 1;
+
+  /* The handler interrupts a pass that holds the stack */
+  ExecuteCallbacks(NULL);
+  UNITTEST_CHECK(emergency_failures == 1);
+  raise(SIGUSR1);
+  UNITTEST_CHECK(emergency_failures == 0);
+  signal(SIGUSR1, old_handler);
+
+  UNITTEST_ASSERT(_CALLBACK_COUNT(func1) == 1);
+  UNITTEST_ASSERT(_CALLBACK_COUNT(func2) == 1);
+  UNITTEST_ASSERT(_CALLBACK_COUNT(func3) == 0);
+  UNITTEST_ASSERT(_CALLBACK_COUNT(func4) == 0);
+
+  UNITTEST_ASSERT(ExecuteEmergencyCallbacks(NULL, 0) == 0);
+  UNITTEST_ASSERT(_CALLBACK_COUNT(func3) == 1);
+}
+
+UNITTEST_TEST_CASE(CallbackSuite, EmergencyCallbacksNeverRunTwice) {
+  void (*old_handler)(int);
+  RegisterCallbackWithId(func1, "func1", NULL, -1);
+  RegisterCallbackWithId(interrupted_callback, "interrupted", NULL, -1);
+  RegisterCallbackWithId(func2, "func2", NULL, -1);
+
+  _CALLBACK_COUNT(func1) = 0;
+  _CALLBACK_COUNT(func2) = 0;
+  _CALLBACK_COUNT(func3) = 0;
+  _CALLBACK_RETVAL(func1) = 1;
+  _CALLBACK_RETVAL(func2) = 1;
+  _CALLBACK_RETVAL(func3) = 1;
+  interrupted_calls = 0;
+  emergency_failures = -1;
+
+  /* The handler fires from inside a callback it would otherwise select */
+  old_handler = signal(SIGUSR1, EmergencyHandler);
+  UNITTEST_ASSERT(ExecuteCallbacksWithId(NULL, -1) == 0);
+  UNITTEST_CHECK(emergency_failures == 0);
+  UNITTEST_ASSERT(interrupted_calls == 1);
+  UNITTEST_ASSERT(_CALLBACK_COUNT(func2) == 1);
+  UNITTEST_ASSERT(_CALLBACK_COUNT(func1) == 1);
+
+  raise(SIGUSR1);
+  UNITTEST_ASSERT(interrupted_calls == 1);
+  UNITTEST_ASSERT(_CALLBACK_COUNT(func2) == 1);
+  UNITTEST_ASSERT(_CALLBACK_COUNT(func1) == 1);
+
+  /* Rebuilding the snapshot keeps what already ran */
+  RegisterCallbackWithId(func3, "func3", NULL, -1);
+  raise(SIGUSR1);
+  signal(SIGUSR1, old_handler);
+  UNITTEST_ASSERT(_CALLBACK_COUNT(func3) == 1);
+  UNITTEST_ASSERT(interrupted_calls == 1);
+  UNITTEST_ASSERT(_CALLBACK_COUNT(func2) == 1);
+  UNITTEST_ASSERT(_CALLBACK_COUNT(func1) == 1);
+}
+
+UNITTEST_TEST_CASE(CallbackSuite, EmergencyCallbacksCantReRegister) {
+  void (*old_handler)(int);
+  RegisterCallbackWithId(emergency_rearming_callback, "rearming", NULL, -1);
+  RegisterCallback(interrupted_callback, "interrupted", NULL);
+  interrupted_calls = 0;
+  emergency_rearm_status = CALLBACK_SUCCESS;
+
+  /* The current node is the interrupted one, which must stay executed */
+  old_handler = signal(SIGUSR1, EmergencyHandler);
+  ExecuteCallbacks(NULL);
+  signal(SIGUSR1, old_handler);
+  UNITTEST_ASSERT(emergency_rearm_status == CALLBACK_FAILURE);
+  UNITTEST_ASSERT(interrupted_calls == 1);
+  UNITTEST_ASSERT(HasPendingCallbacks(0) == 0);
+  ExecuteCallbacks(NULL);
+  UNITTEST_ASSERT(interrupted_calls == 1);
+}
+
 UNITTEST_TESTS = {
     UNITTEST_DECLARE_TEST_CASE(CallbackSuite, CanRegisterCallback),
     UNITTEST_DECLARE_TEST_CASE(CallbackSuite,
@@ -185,5 +800,35 @@ UNITTEST_TESTS = {
     UNITTEST_DECLARE_TEST_CASE(CallbackSuite, CanUnregisterCallback),
     UNITTEST_DECLARE_TEST_CASE(CallbackSuite,
                                UnregisteredCallbacksArentExecuted),
+    UNITTEST_DECLARE_TEST_CASE(CallbackSuite, CanExecuteCallbacksByName),
+    UNITTEST_DECLARE_TEST_CASE(CallbackSuite, CanGetCallbackStatsByName),
+    UNITTEST_DECLARE_TEST_CASE(CallbackSuite, UnregisteredNamesAreForgotten),
+    UNITTEST_DECLARE_TEST_CASE(CallbackSuite,
+                               WatchdogReportsOverrunningCallbacks),
+    UNITTEST_DECLARE_TEST_CASE(CallbackSuite, WatchdogStartsOnlyOnce),
+    UNITTEST_DECLARE_TEST_CASE(CallbackSuite, CanCheckPendingCallbacks),
+    UNITTEST_DECLARE_TEST_CASE(CallbackSuite, EventFdIsReadableWhilePending),
+    UNITTEST_DECLARE_TEST_CASE(CallbackSuite, CanExportStatsToSharedMemory),
+    UNITTEST_DECLARE_TEST_CASE(CallbackSuite,
+                               RetryPolicyRetriesFailingCallbacks),
+    UNITTEST_DECLARE_TEST_CASE(CallbackSuite,
+                               RetryPolicyGivesUpAfterMaxAttempts),
+    UNITTEST_DECLARE_TEST_CASE(CallbackSuite,
+                               OtherPoliciesRunScheduledRetries),
+    UNITTEST_DECLARE_TEST_CASE(CallbackSuite, CanRunTriggeredCallbacks),
+    UNITTEST_DECLARE_TEST_CASE(CallbackSuite,
+                               TriggersDuringAPassRunOneFollowUpPass),
+    UNITTEST_DECLARE_TEST_CASE(CallbackSuite,
+                               TriggersRunAtMostOneFollowUpPass),
+    UNITTEST_DECLARE_TEST_CASE(CallbackSuite, TriggerEventFdWakesTheExecutor),
+    UNITTEST_DECLARE_TEST_CASE(CallbackSuite, CanLimitRegisteredCallbacks),
+    UNITTEST_DECLARE_TEST_CASE(CallbackSuite, CanAccountCallbackMemory),
+    UNITTEST_DECLARE_TEST_CASE(CallbackSuite, ShrinkReleasesPooledMemory),
+    UNITTEST_DECLARE_TEST_CASE(CallbackSuite, ShrinkForgetsUnusedIds),
+    UNITTEST_DECLARE_TEST_CASE(CallbackSuite,
+                               CanExecuteEmergencyCallbacksFromSignal),
+    UNITTEST_DECLARE_TEST_CASE(CallbackSuite, EmergencyCallbacksNeverRunTwice),
+    UNITTEST_DECLARE_TEST_CASE(CallbackSuite,
+                               EmergencyCallbacksCantReRegister),
 
     UNITTEST_END};
\ No newline at end of file